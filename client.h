@@ -12,6 +12,7 @@
 
 #include "httpstatis.h"
 #include "error.h"
+#include "win32.h"
 
 namespace bench {
 
@@ -20,11 +21,36 @@ namespace http = beast::http;           // from <boost/beast/http.hpp>
 namespace net = boost::asio;            // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
+struct ClientOptions {
+    // Connect from this local address when it is set. Connections
+    // spread over several addresses can then go past the ephemeral
+    // port limit of a single address.
+    net::ip::address source;
+    // Send a single request, then hold the connection open and idle
+    bool idle{ false };
+};
+
 class HttpClient : public std::enable_shared_from_this<HttpClient> {
 public:
-    explicit HttpClient(net::io_context& ioc)
+    explicit HttpClient(net::io_context& ioc, ClientOptions const& options = {})
         : resolver_(net::make_strand(ioc))
-        , stream_(net::make_strand(ioc)) {           
+        , stream_(net::make_strand(ioc))
+        , options_(options) {           
+    }
+
+    // The HTTP GET request message every client sends
+    static http::request<http::empty_body> make_request(char const* host,
+            char const* port,
+            char const* target,
+            int version) {
+        http::request<http::empty_body> req;
+        req.version(version);
+        req.method(http::verb::get);
+        req.target(target);
+        req.set(http::field::host, std::string(host) + ":" + std::string(port));
+        req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+        req.set(http::field::accept, "text/plain");
+        return req;
     }
 
     void run(char const* host,
@@ -32,12 +58,7 @@ public:
             char const* target,
             int version) {
         // Set up an HTTP GET request message
-        req_.version(version);
-        req_.method(http::verb::get);
-        req_.target(target);
-        req_.set(http::field::host, std::string(host) + ":" + std::string(port));
-        req_.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-        req_.set(http::field::accept, "text/plain");
+        req_ = make_request(host, port, target, version);
 
         // Look up the domain name
         resolver_.async_resolve(
@@ -50,11 +71,33 @@ public:
 
     void on_resolve(beast::error_code ec, tcp::resolver::results_type results) {
         if (ec)
-            return fail(ec, "resolve");
+            return on_error(ec, "resolve");
 
         // Set a timeout on the operation
         stream_.expires_after(std::chrono::seconds(30));        
 
+        if (!options_.source.is_unspecified()) {
+            // Bind before connecting. Connecting to a range of endpoints
+            // would reopen the socket, so only the first one is tried.
+            // The port is picked at connect time, so it only has to be
+            // unique per source address and server.
+            auto const endpoint = results.begin()->endpoint();
+            stream_.socket().open(endpoint.protocol(), ec);
+            if (!ec)
+                reuse_unicast_port(stream_.socket(), ec);
+            if (!ec)
+                stream_.socket().bind(tcp::endpoint(options_.source, 0), ec);
+            if (ec)
+                return on_error(ec, "bind");
+
+            stream_.async_connect(
+                endpoint,
+                [self = shared_from_this(), endpoint](beast::error_code ec) {
+                    self->on_connect(ec, endpoint);
+                });
+            return;
+        }
+
         // Make the connection on the IP address we get from a lookup
         stream_.async_connect(
             results,
@@ -65,12 +108,13 @@ public:
 
     void on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type endpoint) {
         if (ec)
-            return fail(ec, "connect");        
+            return on_error(ec, "connect");        
 
         // Set a timeout on the operation
         stream_.expires_after(std::chrono::seconds(30));        
 
         // Send the HTTP request to the remote host
+        watch_.reset();
         http::async_write(stream_, req_,
             beast::bind_front_handler(
                 &HttpClient::on_write,
@@ -82,9 +126,10 @@ public:
         stream_.expires_after(std::chrono::seconds(30));
 
         if (ec)
-            return fail(ec, "write");
+            return on_error(ec, "write");
 
         // Receive the HTTP response
+        res_ = {};
         http::async_read(stream_, buffer_, res_,
             beast::bind_front_handler(
                 &HttpClient::on_read,
@@ -95,7 +140,12 @@ public:
         boost::ignore_unused(bytes_transferred);
 
         if (ec)
-            return fail(ec, "read");
+            return on_error(ec, "read");
+
+        if (options_.idle) {
+            HttpStatis::get().update(res_.payload_size().value(), watch_.elapsed());
+            return do_idle();
+        }
 
 #if 0
         // Write the message to standard out
@@ -116,20 +166,50 @@ public:
             return;
         }
 
-        HttpStatis::get().update(res_.payload_size().value());
+        HttpStatis::get().update(res_.payload_size().value(), watch_.elapsed());
 
         buffer_.consume(buffer_.size());
+        watch_.reset();
         http::async_write(stream_, req_,
             beast::bind_front_handler(
                 &HttpClient::on_write,
                 shared_from_this()));
     }
 private:
+    void do_idle() {
+        // Keep nothing but the connection itself
+        req_ = {};
+        res_ = {};
+        buffer_.consume(buffer_.size());
+        buffer_.shrink_to_fit();
+        HttpStatis::get().update_idle(true);
+
+        // The server should neither send anything nor close, so waking
+        // up here means the connection was lost
+        stream_.socket().async_wait(
+            tcp::socket::wait_read,
+            beast::bind_front_handler(
+                &HttpClient::on_idle,
+                shared_from_this()));
+    }
+
+    void on_idle(beast::error_code ec) {
+        HttpStatis::get().update_idle(false);
+        on_error(ec ? ec : net::error::connection_reset, "idle");
+    }
+
+    void on_error(beast::error_code ec, char const* what) {
+        fail(ec, what);
+        HttpStatis::get().update_error(what);
+    }
+
     tcp::resolver resolver_;
     beast::tcp_stream stream_;
     beast::flat_buffer buffer_; // (Must persist between reads)
     http::request<http::empty_body> req_;
     http::response<http::string_body> res_;
+    Stopwatch watch_;
+    ClientOptions options_;
 };
 
 }
@@ -0,0 +1,466 @@
+#pragma once
+
+#include <boost/beast/core/string.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BENCH_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC lets every function use any intrinsic, GCC and Clang need the
+// instruction set enabled per function
+#if defined(BENCH_X86_SIMD) && !defined(_MSC_VER)
+#define BENCH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define BENCH_TARGET(isa)
+#endif
+
+namespace bench {
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+
+// A request parsed in place. Every view points into the caller's
+// buffer and is only valid until that buffer is consumed.
+struct HttpRequestView {
+    enum {
+        kMaxHeaders = 64
+    };
+
+    struct Header {
+        beast::string_view name;
+        beast::string_view value;
+    };
+
+    beast::string_view method;
+    beast::string_view target;
+    unsigned version{ 0 };
+    Header headers[kMaxHeaders];
+    size_t num_headers{ 0 };
+    beast::string_view body;
+    bool keep_alive{ false };
+};
+
+namespace detail {
+
+inline bool is_token_char(char c) noexcept {
+    static bool const tab[256] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //   0
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //  16
+        0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, //  32
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, //  48
+        0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //  64
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, //  80
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //  96
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, // 112
+    };
+    return tab[static_cast<unsigned char>(c)];
+}
+
+inline bool iequals(beast::string_view lhs, beast::string_view rhs) noexcept {
+    if (lhs.size() != rhs.size())
+        return false;
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        if ((lhs[i] | 0x20) != (rhs[i] | 0x20))
+            return false;
+    }
+    return true;
+}
+
+inline unsigned count_trailing_zeros(uint32_t mask) noexcept {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+enum class SimdLevel {
+    kScalar,
+    kSse42,
+    kAvx2
+};
+
+inline SimdLevel detect_simd_level() noexcept {
+#if defined(BENCH_X86_SIMD)
+    unsigned regs[4] = { 0, 0, 0, 0 };
+    auto const cpuid = [&regs](unsigned leaf) {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuidex(info, static_cast<int>(leaf), 0);
+        for (auto i = 0; i < 4; ++i)
+            regs[i] = static_cast<unsigned>(info[i]);
+#else
+        __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    };
+
+    cpuid(0);
+    auto const max_leaf = regs[0];
+    cpuid(1);
+    auto const sse42 = (regs[2] & (1u << 20)) != 0;
+    auto const osxsave = (regs[2] & (1u << 27)) != 0;
+    auto const avx = (regs[2] & (1u << 28)) != 0;
+
+    // AVX2 also needs the OS to save the YMM registers
+    auto avx2 = false;
+    if (max_leaf >= 7 && osxsave && avx) {
+#if defined(_MSC_VER)
+        auto const xcr0 = _xgetbv(0);
+#else
+        unsigned eax = 0;
+        unsigned edx = 0;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        auto const xcr0 = (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+        cpuid(7);
+        avx2 = (xcr0 & 0x6) == 0x6 && (regs[1] & (1u << 5)) != 0;
+    }
+
+    if (avx2)
+        return SimdLevel::kAvx2;
+    if (sse42)
+        return SimdLevel::kSse42;
+#endif
+    return SimdLevel::kScalar;
+}
+
+inline char const* simd_level_name(SimdLevel level) noexcept {
+    switch (level) {
+    case SimdLevel::kAvx2:
+        return "avx2";
+    case SimdLevel::kSse42:
+        return "sse4.2";
+    default:
+        return "scalar";
+    }
+}
+
+// The scanner used by the parser, the widest one the CPU supports.
+// Only changed by the parser check, to cover every scanner.
+inline SimdLevel& simd_level() noexcept {
+    static SimdLevel level = detect_simd_level();
+    return level;
+}
+
+inline char const* scan_target_scalar(char const* p, char const* end) noexcept {
+    for (; p != end; ++p) {
+        auto const c = static_cast<unsigned char>(*p);
+        if (c <= 0x20 || c == 0x7f)
+            return p;
+    }
+    return end;
+}
+
+inline char const* scan_value_scalar(char const* p, char const* end) noexcept {
+    for (; p != end; ++p) {
+        auto const c = static_cast<unsigned char>(*p);
+        if ((c < 0x20 && c != '\t') || c == 0x7f)
+            return p;
+    }
+    return end;
+}
+
+#if defined(BENCH_X86_SIMD)
+BENCH_TARGET("avx2")
+inline char const* scan_target_avx2(char const* p, char const* end) noexcept {
+    auto const space = _mm256_set1_epi8(0x20);
+    auto const del = _mm256_set1_epi8(0x7f);
+    for (; end - p >= 32; p += 32) {
+        auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+        auto const stop = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v),
+            _mm256_cmpeq_epi8(v, del));
+        auto const mask = static_cast<uint32_t>(_mm256_movemask_epi8(stop));
+        if (mask != 0)
+            return p + count_trailing_zeros(mask);
+    }
+    return scan_target_scalar(p, end);
+}
+
+BENCH_TARGET("sse4.2")
+inline char const* scan_target_sse42(char const* p, char const* end) noexcept {
+    static char const ranges[16] = "\x00\x20\x7f\x7f";
+    auto const r = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ranges));
+    for (; end - p >= 16; p += 16) {
+        auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+        auto const index = _mm_cmpestri(r, 4, v, 16,
+            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16)
+            return p + index;
+    }
+    return scan_target_scalar(p, end);
+}
+
+BENCH_TARGET("avx2")
+inline char const* scan_value_avx2(char const* p, char const* end) noexcept {
+    auto const ctl = _mm256_set1_epi8(0x1f);
+    auto const tab = _mm256_set1_epi8('\t');
+    auto const del = _mm256_set1_epi8(0x7f);
+    for (; end - p >= 32; p += 32) {
+        auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+        auto const stop = _mm256_or_si256(
+            _mm256_andnot_si256(
+                _mm256_cmpeq_epi8(v, tab),
+                _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v)),
+            _mm256_cmpeq_epi8(v, del));
+        auto const mask = static_cast<uint32_t>(_mm256_movemask_epi8(stop));
+        if (mask != 0)
+            return p + count_trailing_zeros(mask);
+    }
+    return scan_value_scalar(p, end);
+}
+
+BENCH_TARGET("sse4.2")
+inline char const* scan_value_sse42(char const* p, char const* end) noexcept {
+    static char const ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+    auto const r = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ranges));
+    for (; end - p >= 16; p += 16) {
+        auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+        auto const index = _mm_cmpestri(r, 6, v, 16,
+            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16)
+            return p + index;
+    }
+    return scan_value_scalar(p, end);
+}
+#endif
+
+// Returns the first byte in [p, end) that may not appear in a request
+// target (CTLs, SP and DEL), or `end`.
+inline char const* scan_target(char const* p, char const* end) noexcept {
+#if defined(BENCH_X86_SIMD)
+    switch (simd_level()) {
+    case SimdLevel::kAvx2:
+        return scan_target_avx2(p, end);
+    case SimdLevel::kSse42:
+        return scan_target_sse42(p, end);
+    default:
+        break;
+    }
+#endif
+    return scan_target_scalar(p, end);
+}
+
+// Returns the first byte in [p, end) that may not appear in a field
+// value (CTLs other than HTAB, and DEL), or `end`.
+inline char const* scan_value(char const* p, char const* end) noexcept {
+#if defined(BENCH_X86_SIMD)
+    switch (simd_level()) {
+    case SimdLevel::kAvx2:
+        return scan_value_avx2(p, end);
+    case SimdLevel::kSse42:
+        return scan_value_sse42(p, end);
+    default:
+        break;
+    }
+#endif
+    return scan_value_scalar(p, end);
+}
+
+// Calls `f` for every element of the comma separated `list`, with
+// surrounding whitespace removed. Stops early when `f` returns false.
+template <typename F>
+bool for_each_element(beast::string_view list, F&& f) {
+    for (;;) {
+        auto const comma = list.find(',');
+        auto item = list.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+            item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+            item.remove_suffix(1);
+        if (!f(item))
+            return false;
+        if (comma == beast::string_view::npos)
+            return true;
+        list.remove_prefix(comma + 1);
+    }
+}
+
+// Returns true if `list` is a comma separated list of tokens, where
+// empty elements are allowed
+inline bool is_token_list(beast::string_view list) {
+    return for_each_element(list, [](beast::string_view item) {
+        for (auto c : item) {
+            if (!is_token_char(c))
+                return false;
+        }
+        return true;
+    });
+}
+
+// Returns true if the comma separated `list` contains `token`
+inline bool has_token(beast::string_view list, beast::string_view token) {
+    return !for_each_element(list, [token](beast::string_view item) {
+        return !iequals(item, token);
+    });
+}
+
+}
+
+// A picohttpparser-style HTTP/1.x request parser that works directly
+// on the read buffer. The request target and field values, the long
+// runs of a request, are scanned with AVX2 or SSE4.2 when the CPU
+// supports them, picked once at runtime.
+//
+// Only bodies delimited by Content-Length are supported; requests
+// with Transfer-Encoding, obsolete line folding or more than
+// HttpRequestView::kMaxHeaders fields are rejected.
+class HttpRequestParser final {
+public:
+    enum {
+        kIncomplete = -2,
+        kError = -1
+    };
+
+    enum {
+        kHeaderLimit = 8192,
+        kBodyLimit = 10000
+    };
+
+    // Parse one request from the front of [data, data + size). Returns
+    // the number of bytes the request occupies, kIncomplete if more data
+    // is needed or kError if the request is malformed or unsupported.
+    static int parse(char const* data, size_t size, HttpRequestView& req) noexcept {
+        auto p = data;
+        auto const end = data + size;
+        auto const header_end = data + (std::min)(size, size_t{ kHeaderLimit });
+        auto const incomplete = size < kHeaderLimit ? kIncomplete : kError;
+
+        // method SP
+        auto const method = p;
+        while (p != header_end && detail::is_token_char(*p))
+            ++p;
+        if (p == header_end)
+            return incomplete;
+        if (*p != ' ' || p == method)
+            return kError;
+        req.method = beast::string_view(method, p - method);
+        ++p;
+
+        // request-target SP
+        auto const target = p;
+        p = detail::scan_target(p, header_end);
+        if (p == header_end)
+            return incomplete;
+        if (*p != ' ' || p == target)
+            return kError;
+        req.target = beast::string_view(target, p - target);
+        ++p;
+
+        // HTTP-version CRLF, only HTTP/1.0 and HTTP/1.1 like Beast
+        if (header_end - p < 10)
+            return incomplete;
+        if (std::memcmp(p, "HTTP/1.", 7) != 0
+            || (p[7] != '0' && p[7] != '1')
+            || p[8] != '\r' || p[9] != '\n') {
+            return kError;
+        }
+        req.version = static_cast<unsigned>(10 + (p[7] - '0'));
+        p += 10;
+
+        // *( header-field CRLF ) CRLF
+        size_t content_length = 0;
+        bool has_content_length = false;
+        beast::string_view connection;
+        bool has_connection = false;
+        req.num_headers = 0;
+        for (;;) {
+            if (header_end - p < 2)
+                return incomplete;
+            if (p[0] == '\r') {
+                if (p[1] != '\n')
+                    return kError;
+                p += 2;
+                break;
+            }
+
+            auto const name = p;
+            while (p != header_end && detail::is_token_char(*p))
+                ++p;
+            if (p == header_end)
+                return incomplete;
+            if (*p != ':' || p == name)
+                return kError;
+            auto const name_size = static_cast<size_t>(p - name);
+            ++p;
+
+            while (p != header_end && (*p == ' ' || *p == '\t'))
+                ++p;
+            auto const value = p;
+            p = detail::scan_value(p, header_end);
+            if (header_end - p < 2)
+                return incomplete;
+            if (p[0] != '\r' || p[1] != '\n')
+                return kError;
+            auto value_end = p;
+            while (value_end != value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                --value_end;
+            p += 2;
+
+            if (req.num_headers == HttpRequestView::kMaxHeaders)
+                return kError;
+            auto& header = req.headers[req.num_headers++];
+            header.name = beast::string_view(name, name_size);
+            header.value = beast::string_view(value, value_end - value);
+
+            if (detail::iequals(header.name, "content-length")) {
+                if (has_content_length || !parse_length(header.value, content_length))
+                    return kError;
+                has_content_length = true;
+            } else if (detail::iequals(header.name, "transfer-encoding")) {
+                return kError;
+            } else if (detail::iequals(header.name, "connection")
+                || detail::iequals(header.name, "proxy-connection")) {
+                if (!detail::is_token_list(header.value))
+                    return kError;
+                if (!has_connection && header.name.size() == 10) {
+                    connection = header.value;
+                    has_connection = true;
+                }
+            }
+        }
+
+        if (req.version >= 11)
+            req.keep_alive = !detail::has_token(connection, "close");
+        else
+            req.keep_alive = detail::has_token(connection, "keep-alive");
+
+        if (content_length > kBodyLimit)
+            return kError;
+        if (static_cast<size_t>(end - p) < content_length)
+            return kIncomplete;
+        req.body = beast::string_view(p, content_length);
+        p += content_length;
+        return static_cast<int>(p - data);
+    }
+
+private:
+    static bool is_digit(char c) noexcept {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool parse_length(beast::string_view value, size_t& length) noexcept {
+        if (value.empty())
+            return false;
+        length = 0;
+        for (auto c : value) {
+            if (!is_digit(c) || length > kBodyLimit)
+                return false;
+            length = length * 10 + static_cast<size_t>(c - '0');
+        }
+        return true;
+    }
+};
+
+}
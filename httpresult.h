@@ -0,0 +1,334 @@
+#pragma once
+
+#include <boost/math/distributions/students_t.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "httpstatis.h"
+
+namespace bench {
+
+// The options a set of runs was started with, recorded in the result
+// file so two files can be checked for a like-for-like comparison.
+struct RunConfig {
+    std::string host;
+    std::string port;
+    std::string target;
+    size_t threads{ 0 };
+    size_t clients{ 0 };
+    size_t requests{ 0 };
+    size_t repeat{ 1 };
+    std::string parser;
+    size_t workers{ 0 };
+    size_t handler_cost_us{ 0 };
+};
+
+// Mean and 95% confidence interval of one metric over several runs
+struct Estimate {
+    size_t samples{ 0 };
+    double mean{ 0 };
+    double stddev{ 0 };
+    double ci95{ 0 };
+};
+
+inline Estimate estimate(std::vector<double> const& samples) {
+    Estimate result;
+    result.samples = samples.size();
+    if (samples.empty())
+        return result;
+
+    for (auto sample : samples)
+        result.mean += sample;
+    result.mean /= static_cast<double>(samples.size());
+    if (samples.size() < 2)
+        return result;
+
+    double squares = 0;
+    for (auto sample : samples)
+        squares += (sample - result.mean) * (sample - result.mean);
+    result.stddev = std::sqrt(squares / static_cast<double>(samples.size() - 1));
+
+    boost::math::students_t dist(static_cast<double>(samples.size() - 1));
+    auto const t = boost::math::quantile(boost::math::complement(dist, 0.025));
+    result.ci95 = t * result.stddev / std::sqrt(static_cast<double>(samples.size()));
+    return result;
+}
+
+// A metric compared across runs, whether a larger value is better and
+// whether it is read from the latency histogram
+struct Metric {
+    char const* name;
+    bool higher_is_better;
+    bool histogram;
+    double (*get)(RunResult const& result);
+};
+
+inline std::vector<Metric> const& metrics() {
+    static std::vector<Metric> const metrics = {
+        { "requests_per_second", true, false, [](RunResult const& r) { return r.requests_per_second; } },
+        { "latency_p50_us", false, true, [](RunResult const& r) { return static_cast<double>(r.latency_percentile(50)); } },
+        { "latency_p90_us", false, true, [](RunResult const& r) { return static_cast<double>(r.latency_percentile(90)); } },
+        { "latency_p99_us", false, true, [](RunResult const& r) { return static_cast<double>(r.latency_percentile(99)); } },
+        { "latency_p999_us", false, true, [](RunResult const& r) { return static_cast<double>(r.latency_percentile(99.9)); } },
+    };
+    return metrics;
+}
+
+inline std::string json_string(std::string const& value) {
+    std::ostringstream out;
+    out << '"';
+    for (auto c : value) {
+        switch (c) {
+        case '"':
+            out << "\\\"";
+            break;
+        case '\\':
+            out << "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+            else
+                out << c;
+            break;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+inline void show_summary(std::vector<RunResult> const& results) {
+    std::cout << "Summary of " << results.size() << " runs (mean +/- 95% confidence interval):" << std::endl;
+    for (auto const& metric : metrics()) {
+        std::vector<double> samples;
+        for (auto const& result : results)
+            samples.push_back(metric.get(result));
+        auto const e = estimate(samples);
+        std::cout << "  " << metric.name << ": " << std::fixed << std::setprecision(2)
+            << e.mean << " +/- " << e.ci95 << std::endl;
+    }
+}
+
+// Write the config, every run and the summary as JSON
+inline bool write_results(std::string const& path,
+    RunConfig const& config,
+    std::vector<RunResult> const& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n";
+    out << "  \"config\": {\n"
+        << "    \"host\": " << json_string(config.host) << ",\n"
+        << "    \"port\": " << json_string(config.port) << ",\n"
+        << "    \"target\": " << json_string(config.target) << ",\n"
+        << "    \"threads\": " << config.threads << ",\n"
+        << "    \"clients\": " << config.clients << ",\n"
+        << "    \"requests\": " << config.requests << ",\n"
+        << "    \"repeat\": " << config.repeat << ",\n"
+        << "    \"parser\": " << json_string(config.parser) << ",\n"
+        << "    \"workers\": " << config.workers << ",\n"
+        << "    \"handler_cost_us\": " << config.handler_cost_us << "\n"
+        << "  },\n";
+
+    out << "  \"runs\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto const& result = results[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\n"
+            << "      \"requests\": " << result.requests << ",\n"
+            << "      \"elapsed_seconds\": " << result.elapsed_seconds << ",\n"
+            << "      \"transferred\": " << result.transferred << ",\n";
+        for (auto const& metric : metrics())
+            out << "      \"" << metric.name << "\": " << metric.get(result) << ",\n";
+
+        out << "      \"errors\": {";
+        auto first = true;
+        for (auto const& error : result.errors) {
+            out << (first ? "" : ", ") << json_string(error.first) << ": " << error.second;
+            first = false;
+        }
+        out << "},\n";
+
+        out << "      \"latency_histogram\": [";
+        first = true;
+        for (size_t bucket = 0; bucket < result.latency_counts.size(); ++bucket) {
+            if (result.latency_counts[bucket] == 0)
+                continue;
+            out << (first ? "" : ", ")
+                << "{\"le_us\": " << LatencyHistogram::upper_bound(bucket)
+                << ", \"count\": " << result.latency_counts[bucket] << "}";
+            first = false;
+        }
+        out << "]\n"
+            << "    }";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"summary\": {";
+    for (size_t i = 0; i < metrics().size(); ++i) {
+        auto const& metric = metrics()[i];
+        std::vector<double> samples;
+        for (auto const& result : results)
+            samples.push_back(metric.get(result));
+        auto const e = estimate(samples);
+        out << (i == 0 ? "\n" : ",\n")
+            << "    \"" << metric.name << "\": {\"mean\": " << e.mean
+            << ", \"stddev\": " << e.stddev
+            << ", \"ci95_low\": " << e.mean - e.ci95
+            << ", \"ci95_high\": " << e.mean + e.ci95 << "}";
+    }
+    out << "\n  }\n";
+    out << "}\n";
+    return static_cast<bool>(out);
+}
+
+// Compare two result files metric by metric with Welch's t-test. A
+// metric regresses when the candidate is worse by more than
+// `min_change_percent` and the difference is significant, with Holm's
+// correction keeping the chance of any false alarm across all metrics
+// at `alpha`. Latency percentiles that moved by no more than one
+// histogram bucket are treated as noise.
+// Returns 0 when nothing regressed, 1 on regressions and -1 on errors.
+inline int compare_results(std::string const& baseline_path,
+    std::string const& candidate_path,
+    double min_change_percent,
+    double alpha = 0.05) {
+    namespace pt = boost::property_tree;
+
+    auto const load = [](std::string const& path, pt::ptree& tree) {
+        try {
+            pt::read_json(path, tree);
+            return true;
+        }
+        catch (std::exception const& e) {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+    };
+
+    pt::ptree baseline;
+    pt::ptree candidate;
+    if (!load(baseline_path, baseline) || !load(candidate_path, candidate))
+        return -1;
+
+    for (auto const* key : { "target", "threads", "clients", "requests", "parser", "workers", "handler_cost_us" }) {
+        auto const path = std::string("config.") + key;
+        if (baseline.get<std::string>(path, "") != candidate.get<std::string>(path, "")) {
+            std::cout << "Warning: config." << key << " differs ("
+                << baseline.get<std::string>(path, "") << " vs "
+                << candidate.get<std::string>(path, "") << ")" << std::endl;
+        }
+    }
+
+    auto const samples = [](pt::ptree const& tree, char const* name) {
+        std::vector<double> values;
+        if (auto runs = tree.get_child_optional("runs")) {
+            for (auto const& run : *runs)
+                values.push_back(run.second.get<double>(name, 0));
+        }
+        return values;
+    };
+
+    struct Comparison {
+        Estimate a;
+        Estimate b;
+        double change{ 0 };
+        bool worse{ false };
+        bool within_resolution{ false };
+        double p_value{ 1 };
+        bool significant{ false };
+    };
+
+    auto const& all = metrics();
+    std::vector<Comparison> comparisons(all.size());
+    for (size_t i = 0; i < all.size(); ++i) {
+        auto const& metric = all[i];
+        auto& c = comparisons[i];
+        c.a = estimate(samples(baseline, metric.name));
+        c.b = estimate(samples(candidate, metric.name));
+        if (c.a.samples == 0 || c.b.samples == 0) {
+            std::cerr << "No runs for " << metric.name << std::endl;
+            return -1;
+        }
+
+        c.change = c.a.mean != 0 ? 100.0 * (c.b.mean - c.a.mean) / c.a.mean : 0;
+        c.worse = metric.higher_is_better ? c.change < -min_change_percent : c.change > min_change_percent;
+
+        // Percentiles are bucket bounds, a move to the next bucket is
+        // not a measurable change
+        if (metric.histogram) {
+            auto const resolution = LatencyHistogram::resolution(
+                static_cast<uint64_t>((std::max)(c.a.mean, c.b.mean)));
+            c.within_resolution = std::fabs(c.b.mean - c.a.mean) <= static_cast<double>(resolution);
+            c.worse = c.worse && !c.within_resolution;
+        }
+
+        // Welch's t-test needs at least two runs on each side
+        if (c.a.samples >= 2 && c.b.samples >= 2 && !c.within_resolution) {
+            auto const va = c.a.stddev * c.a.stddev / static_cast<double>(c.a.samples);
+            auto const vb = c.b.stddev * c.b.stddev / static_cast<double>(c.b.samples);
+            if (va + vb > 0) {
+                auto const t = (c.b.mean - c.a.mean) / std::sqrt(va + vb);
+                auto const df = (va + vb) * (va + vb)
+                    / (va * va / static_cast<double>(c.a.samples - 1) + vb * vb / static_cast<double>(c.b.samples - 1));
+                boost::math::students_t dist(df);
+                c.p_value = 2 * boost::math::cdf(boost::math::complement(dist, std::fabs(t)));
+            } else {
+                c.p_value = c.a.mean != c.b.mean ? 0.0 : 1.0;
+            }
+        }
+    }
+
+    // Holm's step-down: the k-th smallest p-value is tested at
+    // alpha / (m - k), stopping at the first one that is not significant
+    std::vector<size_t> order(comparisons.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&comparisons](size_t lhs, size_t rhs) {
+        return comparisons[lhs].p_value < comparisons[rhs].p_value;
+    });
+    for (size_t k = 0; k < order.size(); ++k) {
+        auto& c = comparisons[order[k]];
+        if (c.p_value > alpha / static_cast<double>(order.size() - k))
+            break;
+        c.significant = true;
+    }
+
+    auto regressions = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < all.size(); ++i) {
+        auto const& c = comparisons[i];
+        auto const regressed = c.worse && c.significant;
+        regressions += regressed ? 1 : 0;
+        std::cout << all[i].name << ": " << c.a.mean << " -> " << c.b.mean
+            << " (" << std::showpos << c.change << std::noshowpos << " %, p=" << std::setprecision(4) << c.p_value << std::setprecision(2) << ")"
+            << (regressed ? " REGRESSION" : "")
+            << (c.worse && !c.significant ? " (within noise)" : "")
+            << (c.within_resolution && c.a.mean != c.b.mean ? " (within histogram resolution)" : "") << std::endl;
+    }
+
+    if (samples(baseline, "requests_per_second").size() < 2 || samples(candidate, "requests_per_second").size() < 2)
+        std::cout << "Warning: significance needs at least 2 runs per file, use --repeat" << std::endl;
+
+    if (regressions) {
+        std::cout << "Regressions found: " << regressions << std::endl;
+        return 1;
+    }
+    std::cout << "No significant regressions" << std::endl;
+    return 0;
+}
+
+}
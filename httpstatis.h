@@ -1,9 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace bench {
 
@@ -28,6 +35,121 @@ private:
 	Clock::time_point start_time_;
 };
 
+// Log-linear latency histogram in microseconds. Values below kSubBuckets
+// get a bucket each, every power of two above that is split into
+// kSubBuckets buckets, which bounds the error to about 3%.
+class LatencyHistogram final {
+public:
+	enum {
+		kSubBucketBits = 5,
+		kSubBuckets = 1 << kSubBucketBits,
+		kMaxBit = 40,
+		kBuckets = kSubBuckets + (kMaxBit - kSubBucketBits + 1) * kSubBuckets
+	};
+
+	LatencyHistogram() noexcept {
+		reset();
+	}
+
+	void reset() noexcept {
+		for (auto& count : counts_) {
+			count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void record(uint64_t value) noexcept {
+		counts_[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::vector<uint64_t> counts() const {
+		std::vector<uint64_t> counts(kBuckets);
+		for (size_t i = 0; i < kBuckets; ++i) {
+			counts[i] = counts_[i].load(std::memory_order_relaxed);
+		}
+		return counts;
+	}
+
+	static size_t index_of(uint64_t value) noexcept {
+		if (value < kSubBuckets) {
+			return static_cast<size_t>(value);
+		}
+		auto bit = highest_bit(value);
+		if (bit > kMaxBit) {
+			return kBuckets - 1;
+		}
+		auto shift = bit - kSubBucketBits;
+		auto sub_bucket = static_cast<size_t>(value >> shift) - kSubBuckets;
+		return kSubBuckets + static_cast<size_t>(shift) * kSubBuckets + sub_bucket;
+	}
+
+	// Largest value that falls into bucket `index`
+	static uint64_t upper_bound(size_t index) noexcept {
+		if (index < kSubBuckets) {
+			return index;
+		}
+		auto shift = (index - kSubBuckets) / kSubBuckets;
+		auto sub_bucket = (index - kSubBuckets) % kSubBuckets;
+		return ((uint64_t{ kSubBuckets } + sub_bucket + 1) << shift) - 1;
+	}
+
+	// Width of the bucket `value` falls into, the smallest difference
+	// the histogram can tell apart around `value`
+	static uint64_t resolution(uint64_t value) noexcept {
+		auto index = index_of(value);
+		if (index == 0) {
+			return 1;
+		}
+		return upper_bound(index) - upper_bound(index - 1);
+	}
+
+	// Value at or below which `percentile` percent of `counts` fall
+	static uint64_t percentile(std::vector<uint64_t> const& counts, double percentile) noexcept {
+		uint64_t total = 0;
+		for (auto count : counts) {
+			total += count;
+		}
+		if (total == 0) {
+			return 0;
+		}
+
+		auto rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(total) + 0.5);
+		rank = (std::max)(rank, uint64_t{ 1 });
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); ++i) {
+			seen += counts[i];
+			if (seen >= rank) {
+				return upper_bound(i);
+			}
+		}
+		return upper_bound(counts.size() - 1);
+	}
+
+private:
+	static int highest_bit(uint64_t value) noexcept {
+		auto bit = 0;
+		while (value >>= 1) {
+			++bit;
+		}
+		return bit;
+	}
+
+	std::array<std::atomic<uint64_t>, kBuckets> counts_;
+};
+
+// Everything one benchmark run measured on the client side
+struct RunResult {
+	size_t requests{ 0 };
+	double elapsed_seconds{ 0 };
+	double requests_per_second{ 0 };
+	size_t transferred{ 0 };
+	std::vector<uint64_t> latency_counts;
+	std::map<std::string, size_t> errors;
+
+	uint64_t latency_percentile(double percentile) const noexcept {
+		return LatencyHistogram::percentile(latency_counts, percentile);
+	}
+};
+
 class HttpStatis final {
 public:
 	static HttpStatis& get() {
@@ -41,42 +163,282 @@ public:
 		num_test_request_ = num_test_request;
 		num_clients_ = num_clients;
 		threads_ = threads;
-		num_update_size_ = num_test_request_ / 10;
+		num_update_size_ = (std::max)(num_test_request_ / 10, size_t{ 1 });
+		request_ = 0;
+		total_transferred_ = 0;
+		failed_clients_ = 0;
+		elapsed_us_ = 0;
+		latency_.reset();
+		{
+			std::lock_guard<std::mutex> lock(errors_mutex_);
+			errors_.clear();
+		}
+		io_busy_ns_ = 0;
+		worker_busy_ns_ = 0;
+		delayed_ = 0;
+		delay_requested_us_ = 0;
+		delay_actual_us_ = 0;
+		delay_max_error_us_ = 0;
+		idle_clients_ = 0;
+		reported_ns_ = 0;
+		reported_io_busy_ns_ = 0;
+		reported_worker_busy_ns_ = 0;
 		watch_.reset();
 	}
 
+	void set_server_threads(size_t io_threads, size_t worker_threads) {
+		io_threads_ = io_threads;
+		worker_threads_ = worker_threads;
+	}
+
+	void update_io_busy(std::chrono::nanoseconds busy) noexcept {
+		io_busy_ns_ += static_cast<uint64_t>(busy.count());
+	}
+
+	void update_worker_busy(std::chrono::nanoseconds busy) noexcept {
+		worker_busy_ns_ += static_cast<uint64_t>(busy.count());
+	}
+
+	void update_delay(std::chrono::microseconds requested, std::chrono::microseconds actual) noexcept {
+		auto error = static_cast<uint64_t>((std::max)(actual - requested, std::chrono::microseconds(0)).count());
+		++delayed_;
+		delay_requested_us_ += static_cast<uint64_t>(requested.count());
+		delay_actual_us_ += static_cast<uint64_t>(actual.count());
+		auto max_error = delay_max_error_us_.load(std::memory_order_relaxed);
+		while (error > max_error
+			&& !delay_max_error_us_.compare_exchange_weak(max_error, error, std::memory_order_relaxed)) {
+		}
+	}
+
+	// Counts the server sessions that are open
+	void update_connection(bool opened) noexcept {
+		if (opened) {
+			++connections_;
+		} else {
+			--connections_;
+		}
+	}
+
+	size_t connections() const noexcept {
+		return connections_;
+	}
+
+	// Called when a client got its response and now holds the
+	// connection open without sending anything else, and when it
+	// loses that connection
+	void update_idle(bool idle) noexcept {
+		if (idle) {
+			++idle_clients_;
+		} else {
+			--idle_clients_;
+		}
+	}
+
+	// An idle test is ready once every client is idle or has failed
+	bool idle_ready() const noexcept {
+		return num_clients_ > 0 && idle_clients_ + failed_clients_ >= num_clients_;
+	}
+
+	// The test stops after the requested number of requests, or when
+	// every client has failed
 	bool stop_test() const noexcept {
-		return request_ == num_test_request_;
+		return request_ >= num_test_request_
+			|| (num_clients_ > 0 && failed_clients_ >= num_clients_);
 	}
 
-	void update(size_t transferred_size) {
+	void update(size_t transferred_size, std::chrono::microseconds latency) {
 		auto num_request = ++request_;
 		total_transferred_ += transferred_size;
+		latency_.record(static_cast<uint64_t>(latency.count()));
+		if (num_request == num_test_request_) {
+			elapsed_us_ = static_cast<uint64_t>(watch_.elapsed().count());
+		}
 		if (num_request % num_update_size_ == 0) {
 			std::cout << "Completed " << num_request << " requests" << std::endl;
 		}		
 	}
 
+	// Called when a client gives up after an error
+	void update_error(std::string const& what) {
+		++failed_clients_;
+		std::lock_guard<std::mutex> lock(errors_mutex_);
+		++errors_[what];
+	}
+
+	RunResult snapshot() const {
+		RunResult result;
+		result.requests = (std::min)(request_.load(), num_test_request_);
+		result.elapsed_seconds = elapsed_seconds();
+		result.requests_per_second = result.elapsed_seconds > 0
+			? static_cast<double>(result.requests) / result.elapsed_seconds
+			: 0;
+		result.transferred = total_transferred_;
+		result.latency_counts = latency_.counts();
+		std::lock_guard<std::mutex> lock(errors_mutex_);
+		result.errors = errors_;
+		return result;
+	}
+
 	void show_statistic() {
 		std::cout.setf(std::ios::showpoint);
 
-		auto elapsed = watch_.elapsed<std::chrono::seconds>();
-		auto requst_per_seconds = request_ / static_cast<double>(elapsed.count());
+		auto result = snapshot();
 		std::cout << "Use threads: " << threads_ << std::endl;
 		std::cout << "Number of clients: " << num_clients_ << std::endl;
-		std::cout << "Requests per second: " << std::fixed << std::setprecision(2) << requst_per_seconds << " /sec" << std::endl;
+		std::cout << "Requests per second: " << std::fixed << std::setprecision(2) << result.requests_per_second << " /sec" << std::endl;
 		std::cout << "Total transferred: " << total_transferred_ << " /bytes" << std::endl;
+		std::cout << "Latency p50: " << result.latency_percentile(50)
+			<< " us, p90: " << result.latency_percentile(90)
+			<< " us, p99: " << result.latency_percentile(99)
+			<< " us, p99.9: " << result.latency_percentile(99.9)
+			<< " us, max: " << result.latency_percentile(100) << " us" << std::endl;
+		for (auto const& error : result.errors) {
+			std::cout << "Errors on " << error.first << ": " << error.second << std::endl;
+		}
+
+		show_utilization(io_busy_ns_, worker_busy_ns_, result.elapsed_seconds * 1e9);
+		if (delayed_ > 0) {
+			auto delayed = static_cast<double>(delayed_);
+			auto requested = delay_requested_us_ / delayed;
+			auto actual = delay_actual_us_ / delayed;
+			std::cout << "Delayed responses: " << delayed_ << std::endl;
+			std::cout << "Delay requested: " << requested << " us, actual: " << actual
+				<< " us, mean error: " << actual - requested
+				<< " us, max late: " << delay_max_error_us_ << " us" << std::endl;
+		}
+	}
+
+	// Utilization of a server running without a client in the process,
+	// over the time since the previous call, or since the start when
+	// `since_start` is set. Returns false and prints nothing when the
+	// server was not busy in that time.
+	bool show_server_statistic(bool since_start = false) {
+		auto const now_ns = static_cast<uint64_t>(watch_.elapsed<std::chrono::nanoseconds>().count());
+		auto const io_busy = io_busy_ns_.load();
+		auto const worker_busy = worker_busy_ns_.load();
+		auto const from_ns = since_start ? 0 : reported_ns_;
+		auto const from_io_busy = since_start ? 0 : reported_io_busy_ns_;
+		auto const from_worker_busy = since_start ? 0 : reported_worker_busy_ns_;
+		reported_ns_ = now_ns;
+		reported_io_busy_ns_ = io_busy;
+		reported_worker_busy_ns_ = worker_busy;
+		if (io_busy == from_io_busy && worker_busy == from_worker_busy) {
+			return false;
+		}
+
+		std::cout.setf(std::ios::showpoint);
+		std::cout << std::fixed << std::setprecision(2);
+		std::cout << (since_start ? "Server since start, " : "Server last ")
+			<< static_cast<double>(now_ns - from_ns) / 1e9 << " s" << std::endl;
+		show_utilization(io_busy - from_io_busy, worker_busy - from_worker_busy, static_cast<double>(now_ns - from_ns));
+		return true;
+	}
+
+	// Splits the growth of the process memory since `baseline_memory`
+	// over the idle clients, or over the server connections when this
+	// process only runs the server
+	void show_idle_statistic(size_t baseline_memory, size_t memory) const {
+		auto const connections = idle_clients_ > 0 ? idle_clients_.load() : connections_.load();
+		std::cout << "Idle clients: " << idle_clients_ << ", failed: " << failed_clients_
+			<< ", server connections: " << connections_ << std::endl;
+		{
+			std::lock_guard<std::mutex> lock(errors_mutex_);
+			for (auto const& error : errors_) {
+				std::cout << "Errors on " << error.first << ": " << error.second << std::endl;
+			}
+		}
+		std::cout << "Process memory: " << std::fixed << std::setprecision(2)
+			<< static_cast<double>(baseline_memory) / (1024 * 1024) << " MB before, "
+			<< static_cast<double>(memory) / (1024 * 1024) << " MB now" << std::endl;
+		if (connections > 0) {
+			auto growth = memory > baseline_memory ? memory - baseline_memory : 0;
+			std::cout << "Memory per idle connection: " << growth / connections << " bytes" << std::endl;
+		}
 	}
 
 private:
 	HttpStatis() = default;
 
+	double elapsed_seconds() const noexcept {
+		auto elapsed_us = elapsed_us_.load();
+		if (elapsed_us == 0) {
+			elapsed_us = static_cast<uint64_t>(watch_.elapsed().count());
+		}
+		return static_cast<double>(elapsed_us) / 1e6;
+	}
+
+	void show_utilization(uint64_t io_busy_ns, uint64_t worker_busy_ns, double elapsed_ns) const {
+		if (io_threads_ > 0) {
+			std::cout << "Server I/O threads: " << io_threads_
+				<< ", utilization: " << utilization(io_busy_ns, io_threads_, elapsed_ns) << " %" << std::endl;
+		}
+		if (worker_threads_ > 0) {
+			std::cout << "Handler worker threads: " << worker_threads_
+				<< ", utilization: " << utilization(worker_busy_ns, worker_threads_, elapsed_ns) << " %" << std::endl;
+		}
+	}
+
+	static double utilization(uint64_t busy_ns, size_t threads, double elapsed_ns) noexcept {
+		if (elapsed_ns <= 0) {
+			return 0;
+		}
+		return 100.0 * static_cast<double>(busy_ns) / (elapsed_ns * static_cast<double>(threads));
+	}
+
 	size_t num_clients_{ 0 };
 	size_t num_test_request_{ 0 };
 	size_t num_update_size_{ 0 };
 	size_t threads_{0};
 	std::atomic<size_t> request_{ 0 };
 	std::atomic<size_t> total_transferred_{ 0 };
+	std::atomic<size_t> failed_clients_{ 0 };
+	std::atomic<uint64_t> elapsed_us_{ 0 };
+	LatencyHistogram latency_;
+	mutable std::mutex errors_mutex_;
+	std::map<std::string, size_t> errors_;
+	size_t io_threads_{ 0 };
+	size_t worker_threads_{ 0 };
+	std::atomic<uint64_t> io_busy_ns_{ 0 };
+	std::atomic<uint64_t> worker_busy_ns_{ 0 };
+	std::atomic<uint64_t> delayed_{ 0 };
+	std::atomic<uint64_t> delay_requested_us_{ 0 };
+	std::atomic<uint64_t> delay_actual_us_{ 0 };
+	std::atomic<uint64_t> delay_max_error_us_{ 0 };
+	std::atomic<size_t> connections_{ 0 };
+	std::atomic<size_t> idle_clients_{ 0 };
+	uint64_t reported_ns_{ 0 };
+	uint64_t reported_io_busy_ns_{ 0 };
+	uint64_t reported_worker_busy_ns_{ 0 };
+	Stopwatch watch_;
+};
+
+// Adds the lifetime of the scope to the busy time of the calling
+// server I/O thread or handler worker.
+class BusyScope final {
+public:
+	enum Kind {
+		kIoThread,
+		kWorker
+	};
+
+	explicit BusyScope(Kind kind) noexcept
+		: kind_(kind) {
+	}
+
+	BusyScope(BusyScope const&) = delete;
+	BusyScope& operator=(BusyScope const&) = delete;
+
+	~BusyScope() {
+		auto busy = watch_.elapsed<std::chrono::nanoseconds>();
+		if (kind_ == kIoThread) {
+			HttpStatis::get().update_io_busy(busy);
+		} else {
+			HttpStatis::get().update_worker_busy(busy);
+		}
+	}
+
+private:
+	Kind kind_;
 	Stopwatch watch_;
 };
 
@@ -1,5 +1,6 @@
 #include "server.h"
 #include "client.h"
+#include "httpresult.h"
 #include "httpstatis.h"
 
 #include <boost/program_options.hpp>
@@ -12,15 +13,21 @@ namespace program_options = boost::program_options;
 
 namespace bench {
 
-std::shared_ptr<HttpServer> make_http_server(net::io_context &ioc, const std::string &host, const std::string& bind_port) {
+std::shared_ptr<HttpServer> make_http_server(net::io_context &ioc, const std::string &host, const std::string& bind_port, size_t handler_cost, WorkStealingPool* handler_pool, DelayScheduler* delay_scheduler, bool fast_parser, bool release_idle) {
     auto const address = net::ip::make_address(host);
     auto const port = static_cast<unsigned short>(std::atoi(bind_port.c_str()));
-    auto const doc_root = std::make_shared<std::string>("/html");
+    auto const options = std::make_shared<ServerOptions>();
+    options->doc_root = "/html";
+    options->handler_cost = std::chrono::microseconds(handler_cost);
+    options->handler_pool = handler_pool;
+    options->delay_scheduler = delay_scheduler;
+    options->fast_parser = fast_parser;
+    options->release_idle = release_idle;
 
     auto server = std::make_shared<bench::HttpServer>(
         ioc,
         tcp::endpoint{ address, port },
-        doc_root);    
+        options);    
     server->run();
 
     std::cout << "Http server lisen:" << address << ":" << port << std::endl;
@@ -29,8 +36,8 @@ std::shared_ptr<HttpServer> make_http_server(net::io_context &ioc, const std::st
     return server;
 }
 
-std::shared_ptr<HttpClient> make_http_client(net::io_context& ioc, const std::string& host, const std::string& bind_port, const std::string& request_path) {
-    auto client = std::make_shared<bench::HttpClient>(ioc);
+std::shared_ptr<HttpClient> make_http_client(net::io_context& ioc, const std::string& host, const std::string& bind_port, const std::string& request_path, ClientOptions const& options) {
+    auto client = std::make_shared<bench::HttpClient>(ioc, options);
     client->run(host.c_str(), bind_port.c_str(), request_path.c_str(), 11);
     return client;
 }
@@ -38,12 +45,31 @@ std::shared_ptr<HttpClient> make_http_client(net::io_context& ioc, const std::st
 }
 
 int main(int argc, char *argv[]) {
+    // httpbench compare <baseline.json> <candidate.json> [min change %] [alpha]
+    if (argc >= 2 && std::string(argv[1]) == "compare") {
+        if (argc < 4) {
+            std::cout << "httpbench compare <baseline.json> <candidate.json> [min change %, default 2] [alpha, default 0.05]" << std::endl;
+            return -1;
+        }
+        auto min_change = argc >= 5 ? std::atof(argv[4]) : 2.0;
+        auto alpha = argc >= 6 ? std::atof(argv[5]) : 0.05;
+        return bench::compare_results(argv[2], argv[3], min_change, alpha);
+    }
+
     auto threads = std::thread::hardware_concurrency();
     std::string port = "5050";
     std::string host = "127.0.0.1";
     size_t client_count = 100;
     size_t num_test_request = 500000;
     std::string request_path = "/version";
+    size_t handler_cost = 0;
+    size_t worker_count = 0;
+    bool fast_parser = false;
+    size_t repeat = 1;
+    std::string result_path;
+    bool idle = false;
+    size_t idle_seconds = 0;
+    size_t source_count = 0;
 
     program_options::options_description options("Test Options");
     options.add_options()
@@ -53,7 +79,15 @@ int main(int argc, char *argv[]) {
         ("p", program_options::value<std::string>(), "port")
         ("t", program_options::value<size_t>(), "number of thread")
         ("n", program_options::value<size_t>(), "number of test request")
-        ("c", program_options::value<size_t>(), "number of concurrent client");
+        ("c", program_options::value<size_t>(), "number of concurrent client")
+        ("r", program_options::value<std::string>(), "request target, e.g. /delay/1000 or /jitter/exp:500")
+        ("cpu", program_options::value<size_t>(), "synthetic handler cpu cost in microseconds")
+        ("w", program_options::value<size_t>(), "number of handler worker threads, 0 runs handlers on the io threads")
+        ("parser", program_options::value<std::string>(), "server request parser, 'beast' or 'fast'")
+        ("repeat", program_options::value<size_t>(), "number of runs, reports mean and 95% confidence interval")
+        ("o", program_options::value<std::string>(), "write the results as json to this file")
+        ("idle", program_options::value<size_t>(), "idle mode, every client sends one request and holds its connection open this many seconds, reports memory per connection")
+        ("src", program_options::value<size_t>(), "spread client connections over source addresses 127.0.0.1 to 127.0.0.N");
 
     program_options::variables_map options_var;
 
@@ -100,27 +134,73 @@ int main(int argc, char *argv[]) {
     if (options_var.count("c")) {
         client_count = options_var["c"].as<size_t>();
     }
+    if (options_var.count("r")) {
+        request_path = options_var["r"].as<std::string>();
+    }
+    if (options_var.count("cpu")) {
+        handler_cost = options_var["cpu"].as<size_t>();
+    }
+    if (options_var.count("w")) {
+        worker_count = options_var["w"].as<size_t>();
+    }
+    if (options_var.count("parser")) {
+        fast_parser = options_var["parser"].as<std::string>() == "fast";
+    }
+    if (options_var.count("repeat")) {
+        repeat = (std::max)(options_var["repeat"].as<size_t>(), size_t{ 1 });
+    }
+    if (options_var.count("o")) {
+        result_path = options_var["o"].as<std::string>();
+    }
+    if (options_var.count("idle")) {
+        idle = true;
+        idle_seconds = options_var["idle"].as<size_t>();
+    }
+    if (options_var.count("src")) {
+        source_count = options_var["src"].as<size_t>();
+    }
 
-    bench::HttpStatis::get().set_test_request_size(
-        num_test_request,
-        client_count,
-        threads);
-    
-    net::io_context client_ioc(threads);
     net::io_context server_ioc(threads);
+    std::atomic<bool> interrupted{ false };
+
+    // The client of the current run, stopped on Ctrl+C as well
+    std::mutex client_ioc_mutex;
+    net::io_context* running_client_ioc = nullptr;
 
-    net::signal_set signals(server_ioc, SIGINT, SIGTERM);
+    // Signals get a context of their own, the server context does not
+    // run in client mode
+    net::io_context signal_ioc;
+    net::signal_set signals(signal_ioc, SIGINT, SIGTERM);
     signals.async_wait(
-        [&](beast::error_code const&, int) {
+        [&](beast::error_code const& ec, int) {
+            if (ec) {
+                return;
+            }
+            interrupted = true;
             server_ioc.stop();
-            client_ioc.stop();
-            std::cout << "Http server was stopped." << std::endl;
+            {
+                std::lock_guard<std::mutex> lock(client_ioc_mutex);
+                if (running_client_ioc) {
+                    running_client_ioc->stop();
+                }
+            }
+            std::cout << (is_server ? "Http server was stopped." : "Http client was stopped.") << std::endl;
+        });
+    std::thread signal_thread([&signal_ioc] {
+        signal_ioc.run();
         });
 
     std::vector<std::thread> server_threads;
     std::shared_ptr<bench::HttpServer> server;
+    std::unique_ptr<bench::WorkStealingPool> handler_pool;
+    std::unique_ptr<bench::DelayScheduler> delay_scheduler;
     if (is_server) {
-        server = bench::make_http_server(server_ioc, host, port);
+        delay_scheduler = std::make_unique<bench::DelayScheduler>(server_ioc, threads);
+        if (worker_count > 0) {
+            handler_pool = std::make_unique<bench::WorkStealingPool>(worker_count);
+        }
+        bench::HttpStatis::get().set_server_threads(threads, worker_count);
+        server = bench::make_http_server(server_ioc, host, port, handler_cost, handler_pool.get(), delay_scheduler.get(), fast_parser, idle);
 
         server_threads.reserve(threads);
         for (auto i = 0; i < threads; ++i) {
@@ -129,44 +209,142 @@ int main(int argc, char *argv[]) {
                 });
         }
     }    
-       
-    std::vector<std::shared_ptr<bench::HttpClient>> clients;
-    std::vector<std::thread> client_threads;
-
-    if (is_client) {
-        clients.reserve(client_count);
-        for (size_t i = 0; i < client_count; ++i) {
-            clients.push_back(bench::make_http_client(client_ioc, host, port, request_path));
+
+    // Every run gets fresh clients on a fresh io_context, so nothing of
+    // the previous run leaks into the next one. The server keeps running.
+    std::vector<bench::RunResult> results;
+    for (size_t run = 0; run < repeat && !interrupted; ++run) {
+        // In idle mode every client sends a single request
+        bench::HttpStatis::get().set_test_request_size(
+            idle ? client_count : num_test_request,
+            client_count,
+            threads);
+        auto const baseline_memory = bench::process_memory_usage();
+
+        net::io_context client_ioc(threads);
+        std::vector<std::shared_ptr<bench::HttpClient>> clients;
+        std::vector<std::thread> client_threads;
+        {
+            std::lock_guard<std::mutex> lock(client_ioc_mutex);
+            running_client_ioc = &client_ioc;
         }
-        client_threads.reserve(threads);
-        for (auto i = 0; i < threads; ++i) {
-            client_threads.emplace_back([&client_ioc] {
-                client_ioc.run();
-                });
+
+        if (is_client) {
+            if (repeat > 1) {
+                std::cout << "Run " << run + 1 << " of " << repeat << std::endl;
+            }
+            clients.reserve(client_count);
+            for (size_t i = 0; i < client_count; ++i) {
+                bench::ClientOptions client_options;
+                client_options.idle = idle;
+                if (source_count > 0) {
+                    // 127.0.0.1, 127.0.0.2, ... the local port only has to be
+                    // unique per address, so this goes past the 16k ports of
+                    // the default ephemeral range
+                    client_options.source = net::ip::make_address_v4(
+                        0x7f000001 + static_cast<net::ip::address_v4::uint_type>(i % source_count));
+                }
+                clients.push_back(bench::make_http_client(client_ioc, host, port, request_path, client_options));
+            }
+            client_threads.reserve(threads);
+            for (auto i = 0; i < threads; ++i) {
+                client_threads.emplace_back([&client_ioc] {
+                    client_ioc.run();
+                    });
+            }
         }
-    }    
 
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-        if (bench::HttpStatis::get().stop_test()) {
-            bench::HttpStatis::get().show_statistic();
-            server_ioc.stop();
-            client_ioc.stop();
-            break;
+        size_t polls = 0;
+        size_t reported_connections = 0;
+        while (!interrupted) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            auto& statis = bench::HttpStatis::get();
+            if (idle && !is_client) {
+                // A server on its own reports every second its connection
+                // count changed
+                if (++polls % 10 == 0 && statis.connections() != reported_connections) {
+                    reported_connections = statis.connections();
+                    statis.show_idle_statistic(baseline_memory, bench::process_memory_usage());
+                }
+                continue;
+            }
+            if (!is_client) {
+                // A server on its own reports its utilization every five
+                // seconds it was busy
+                if (++polls % 50 == 0) {
+                    statis.show_server_statistic();
+                }
+                continue;
+            }
+            if (idle) {
+                if (!statis.idle_ready()) {
+                    continue;
+                }
+                statis.show_idle_statistic(baseline_memory, bench::process_memory_usage());
+                if (idle_seconds == 0) {
+                    break;
+                }
+
+                std::cout << "Holding the connections idle for " << idle_seconds << " seconds" << std::endl;
+                bench::Stopwatch hold;
+                while (!interrupted && hold.elapsed<std::chrono::seconds>().count() < static_cast<int64_t>(idle_seconds)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                statis.show_idle_statistic(baseline_memory, bench::process_memory_usage());
+                break;
+            }
+            if (statis.stop_test()) {
+                statis.show_statistic();
+                results.push_back(statis.snapshot());
+                break;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(client_ioc_mutex);
+            running_client_ioc = nullptr;
+        }
+        client_ioc.stop();
+        for (auto& t : client_threads) {
+            if (!t.joinable()) {
+                continue;
+            }
+            t.join();
         }
     }
 
+    server_ioc.stop();
     for (auto& t : server_threads) {
         if (!t.joinable()) {
             continue;
         }
         t.join();
     }    
+    if (is_server && !is_client) {
+        bench::HttpStatis::get().show_server_statistic(true);
+    }
 
-    for (auto& t : client_threads) {
-        if (!t.joinable()) {
-            continue;
+    signal_ioc.stop();
+    signal_thread.join();
+
+    if (results.size() > 1) {
+        bench::show_summary(results);
+    }
+    if (!result_path.empty() && !results.empty()) {
+        bench::RunConfig config;
+        config.host = host;
+        config.port = port;
+        config.target = request_path;
+        config.threads = threads;
+        config.clients = client_count;
+        config.requests = num_test_request;
+        config.repeat = repeat;
+        config.parser = fast_parser ? "fast" : "beast";
+        config.workers = worker_count;
+        config.handler_cost_us = handler_cost;
+        if (!bench::write_results(result_path, config, results)) {
+            return -1;
         }
-        t.join();
+        std::cout << "Results written to " << result_path << std::endl;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,437 @@
+#include "server.h"
+#include "client.h"
+#include "httpparser.h"
+#include "httpstatis.h"
+
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+namespace program_options = boost::program_options;
+
+namespace bench {
+
+// Publishes the address of a computed value so the compiler has to
+// keep the work that produced it.
+template <typename T>
+void do_not_optimize(T const& value) noexcept {
+    static std::atomic<void const*> sink{ nullptr };
+    sink.store(&value, std::memory_order_relaxed);
+}
+
+// A small Google Benchmark style harness. Every benchmark is a body
+// that runs the measured operation a given number of times; the count
+// is calibrated to the minimum time, then the batch is repeated and
+// the median time per operation is reported.
+class MicroBench final {
+public:
+    MicroBench(std::string filter, std::chrono::milliseconds min_time, size_t repetitions)
+        : filter_(std::move(filter))
+        , min_time_(min_time)
+        , repetitions_((std::max)(repetitions, size_t{ 1 })) {
+        std::cout << std::left << std::setw(36) << "Benchmark"
+            << std::right << std::setw(12) << "Iterations"
+            << std::setw(12) << "ns/op"
+            << std::setw(10) << "spread"
+            << std::setw(12) << "MB/s" << std::endl;
+    }
+
+    // `bytes` is the input handled per operation, when set the
+    // throughput is reported as well
+    template <typename Body>
+    void run(std::string const& name, Body&& body, size_t bytes = 0) {
+        if (!filter_.empty() && name.find(filter_) == std::string::npos)
+            return;
+
+        auto const target = std::chrono::duration_cast<std::chrono::nanoseconds>(min_time_);
+        size_t iterations = 1;
+        for (;;) {
+            auto const elapsed = time(body, iterations);
+            if (elapsed >= target || iterations >= kMaxIterations)
+                break;
+            auto const scale = static_cast<double>(target.count())
+                / static_cast<double>((std::max)(elapsed.count(), std::chrono::nanoseconds::rep{ 1 }));
+            iterations = static_cast<size_t>(static_cast<double>(iterations) * (std::min)(scale * 1.2, 100.0)) + 1;
+            iterations = (std::min)(iterations, static_cast<size_t>(kMaxIterations));
+        }
+
+        std::vector<double> samples;
+        for (size_t i = 0; i < repetitions_; ++i) {
+            auto const elapsed = time(body, iterations);
+            samples.push_back(static_cast<double>(elapsed.count()) / static_cast<double>(iterations));
+        }
+        std::sort(samples.begin(), samples.end());
+        auto const median = samples[samples.size() / 2];
+        auto const spread = median > 0 ? 100.0 * (samples.back() - samples.front()) / median : 0;
+
+        std::cout << std::left << std::setw(36) << name
+            << std::right << std::setw(12) << iterations
+            << std::fixed << std::setprecision(1)
+            << std::setw(12) << median
+            << std::setw(9) << spread << '%';
+        if (bytes > 0 && median > 0)
+            std::cout << std::setw(12) << static_cast<double>(bytes) * 1e3 / median;
+        std::cout << std::endl;
+    }
+
+private:
+    enum {
+        kMaxIterations = 1 << 30
+    };
+
+    template <typename Body>
+    static std::chrono::nanoseconds time(Body& body, size_t iterations) {
+        Stopwatch watch;
+        body(iterations);
+        return watch.elapsed<std::chrono::nanoseconds>();
+    }
+
+    std::string filter_;
+    std::chrono::milliseconds min_time_;
+    size_t repetitions_;
+};
+
+// Runs a body on several threads at once. The helper threads are
+// started once and spin between batches, so every batch is released to
+// all threads together and measures the body, not thread start-up.
+class ThreadGroup final {
+public:
+    explicit ThreadGroup(size_t threads) {
+        for (size_t i = 1; i < threads; ++i)
+            helpers_.emplace_back([this, i] { work(i); });
+    }
+
+    ThreadGroup(ThreadGroup const&) = delete;
+    ThreadGroup& operator=(ThreadGroup const&) = delete;
+
+    ~ThreadGroup() {
+        stop_ = true;
+        ++generation_;
+        for (auto& t : helpers_)
+            t.join();
+    }
+
+    // Calls `body(index)` on every thread, the calling thread is index
+    // 0, and returns once all of them finished
+    void run(std::function<void(size_t)> body) {
+        body_ = std::move(body);
+        pending_ = helpers_.size();
+        ++generation_;
+        body_(0);
+        while (pending_ != 0)
+            std::this_thread::yield();
+    }
+
+private:
+    void work(size_t index) {
+        uint64_t seen = 0;
+        for (;;) {
+            uint64_t generation;
+            while ((generation = generation_) == seen)
+                std::this_thread::yield();
+            seen = generation;
+            if (stop_)
+                return;
+            body_(index);
+            --pending_;
+        }
+    }
+
+    std::function<void(size_t)> body_;
+    std::atomic<uint64_t> generation_{ 0 };
+    std::atomic<size_t> pending_{ 0 };
+    std::atomic<bool> stop_{ false };
+    std::vector<std::thread> helpers_;
+};
+
+// Stands in for HttpSession behind the work queue. Writes complete
+// immediately, so only the queue itself is measured.
+class NullSession final {
+public:
+    using WorkQueue = BasicWorkQueue<NullSession>;
+
+    template<bool isRequest, class Body, class Fields>
+    void do_write(http::message<isRequest, Body, Fields>& msg) {
+        do_not_optimize(msg);
+    }
+};
+
+// Serialize `msg` the way http::write does, into a fixed buffer in
+// place of the socket. Returns the number of bytes produced.
+template<bool isRequest, class Body, class Fields>
+size_t serialize(http::message<isRequest, Body, Fields> const& msg) {
+    static char out[16384];
+    http::serializer<isRequest, Body, Fields> sr{ msg };
+    beast::error_code ec;
+    size_t total = 0;
+    do {
+        sr.next(ec, [&](beast::error_code& ec, auto const& buffers) {
+            ec = {};
+            auto const n = net::buffer_copy(net::buffer(out), buffers);
+            total += n;
+            sr.consume(n);
+        });
+    } while (!ec && !sr.is_done());
+    do_not_optimize(out);
+    return total;
+}
+
+std::string serialize_to_string(http::request<http::empty_body> const& req) {
+    std::ostringstream out;
+    out << req;
+    return out.str();
+}
+
+// Requests recorded from the tool's own client and from common clients
+struct RecordedRequest {
+    char const* name;
+    std::string data;
+};
+
+std::vector<RecordedRequest> recorded_requests() {
+    auto const client = serialize_to_string(HttpClient::make_request("127.0.0.1", "5050", "/version", 11));
+
+    std::string pipelined;
+    for (auto i = 0; i < 16; ++i)
+        pipelined += client;
+
+    std::string const body = "{\"name\":\"widget\",\"tags\":[\"blue\",\"small\"],\"price\":12.5,\"stock\":42,\"owner\":\"team-a\"}";
+
+    return {
+        { "client_get", client },
+        { "client_get_x16", pipelined },
+        { "browser_get",
+            "GET /api/v1/items?page=3&sort=updated&filter=active%2Cpending HTTP/1.1\r\n"
+            "Host: www.example.com\r\n"
+            "Connection: keep-alive\r\n"
+            "Cache-Control: max-age=0\r\n"
+            "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+            "sec-ch-ua-mobile: ?0\r\n"
+            "sec-ch-ua-platform: \"Windows\"\r\n"
+            "Upgrade-Insecure-Requests: 1\r\n"
+            "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+            "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+            "Sec-Fetch-Site: same-origin\r\n"
+            "Sec-Fetch-Mode: navigate\r\n"
+            "Sec-Fetch-User: ?1\r\n"
+            "Sec-Fetch-Dest: document\r\n"
+            "Referer: https://www.example.com/api/v1/items?page=2\r\n"
+            "Accept-Encoding: gzip, deflate, br\r\n"
+            "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+            "Cookie: session=8f2d9c4e1b7a4f0e9d3c2b1a0f9e8d7c; theme=dark; _ga=GA1.2.1234567890.1697040000\r\n"
+            "\r\n" },
+        { "post_json",
+            "POST /api/v1/items HTTP/1.1\r\n"
+            "Host: 127.0.0.1:5050\r\n"
+            "User-Agent: curl/8.4.0\r\n"
+            "Accept: */*\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "\r\n" + body },
+    };
+}
+
+void bench_statis_update(MicroBench& bench) {
+    for (size_t threads : { 1, 2, 4, 8 }) {
+        // Large enough that the progress line is never printed
+        HttpStatis::get().set_test_request_size((std::numeric_limits<size_t>::max)(), 1, threads);
+
+        ThreadGroup group(threads);
+        bench.run("statis_update/threads:" + std::to_string(threads), [&group, threads](size_t iterations) {
+            auto const per_thread = (iterations + threads - 1) / threads;
+            group.run([per_thread](size_t i) {
+                for (size_t n = 0; n < per_thread; ++n)
+                    HttpStatis::get().update(100, std::chrono::microseconds(50 + (n + i) % 1000));
+            });
+        });
+    }
+}
+
+void bench_work_queue(MicroBench& bench) {
+    ServerOptions const options;
+    auto const response = make_response(options, 11, true);
+
+    // One operation is a response queued and its write completed, in
+    // batches of `depth` pipelined responses
+    for (size_t depth : { 1, 16, 256, 4096 }) {
+        bench.run("work_queue/depth:" + std::to_string(depth), [&response, depth](size_t iterations) {
+            NullSession session;
+            NullSession::WorkQueue queue(session);
+            for (size_t done = 0; done < iterations;) {
+                auto const batch = (std::min)(depth, iterations - done);
+                for (size_t i = 0; i < batch; ++i) {
+                    auto res = response;
+                    queue(std::move(res));
+                }
+                for (size_t i = 0; i < batch; ++i)
+                    queue.on_write();
+                done += batch;
+            }
+        });
+    }
+}
+
+void bench_client_request(MicroBench& bench) {
+    bench.run("client_request/build", [](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            auto req = HttpClient::make_request("127.0.0.1", "5050", "/version", 11);
+            do_not_optimize(req);
+        }
+    });
+
+    auto const req = HttpClient::make_request("127.0.0.1", "5050", "/version", 11);
+    auto const size = serialize(req);
+    bench.run("client_request/serialize", [&req](size_t iterations) {
+        size_t total = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            total += serialize(req);
+        do_not_optimize(total);
+    }, size);
+}
+
+void bench_handle_request(MicroBench& bench) {
+    ServerOptions const options;
+    auto const send = [](auto&& res) {
+        do_not_optimize(res);
+    };
+
+    auto const data = serialize_to_string(HttpClient::make_request("127.0.0.1", "5050", "/version", 11));
+    http::request_parser<http::string_body> parser;
+    beast::error_code ec;
+    parser.put(net::buffer(data), ec);
+    auto req = parser.release();
+
+    // handle_request only reads the version and keep-alive of the
+    // request, so the same request is passed every time
+    bench.run("handle_request/beast", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i)
+            handle_request(options, std::move(req), send);
+    });
+
+    HttpRequestView view;
+    HttpRequestParser::parse(data.data(), data.size(), view);
+    bench.run("handle_request/view", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i)
+            handle_request(options, view, send);
+    });
+
+    auto const res = make_response(options, 11, true);
+    auto const size = serialize(res);
+    bench.run("handle_request/serialize", [&res](size_t iterations) {
+        size_t total = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            total += serialize(res);
+        do_not_optimize(total);
+    }, size);
+}
+
+void bench_parser(MicroBench& bench) {
+    for (auto const& recorded : recorded_requests()) {
+        auto const& data = recorded.data;
+        HttpRequestView view;
+        if (HttpRequestParser::parse(data.data(), data.size(), view) < 0) {
+            std::cerr << "Recorded request " << recorded.name << " does not parse" << std::endl;
+            continue;
+        }
+
+        // Like HttpSession, a fresh parser for every request
+        bench.run(std::string("parse/beast/") + recorded.name, [&data](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i) {
+                size_t offset = 0;
+                while (offset < data.size()) {
+                    http::request_parser<http::string_body> parser;
+                    parser.eager(true);
+                    parser.body_limit(10000);
+                    beast::error_code ec;
+                    offset += parser.put(net::buffer(data.data() + offset, data.size() - offset), ec);
+                    if (ec || !parser.is_done())
+                        return;
+                    do_not_optimize(parser.get());
+                }
+            }
+        }, data.size());
+
+        // Once per scanner the CPU supports
+        auto const detected = detail::detect_simd_level();
+        for (auto level : { detail::SimdLevel::kAvx2, detail::SimdLevel::kSse42, detail::SimdLevel::kScalar }) {
+            if (level > detected)
+                continue;
+            detail::simd_level() = level;
+            bench.run(std::string("parse/fast-") + detail::simd_level_name(level) + "/" + recorded.name, [&data](size_t iterations) {
+                HttpRequestView req;
+                for (size_t i = 0; i < iterations; ++i) {
+                    size_t offset = 0;
+                    while (offset < data.size()) {
+                        auto const result = HttpRequestParser::parse(data.data() + offset, data.size() - offset, req);
+                        if (result < 0)
+                            return;
+                        offset += static_cast<size_t>(result);
+                        do_not_optimize(req);
+                    }
+                }
+            }, data.size());
+        }
+        detail::simd_level() = detected;
+    }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    size_t min_time = 200;
+    size_t repetitions = 5;
+
+    program_options::options_description options("Micro-benchmark Options");
+    options.add_options()
+        ("help", "microbench --f parse --m 200 --r 5")
+        ("f", program_options::value<std::string>(), "only run benchmarks whose name contains this")
+        ("m", program_options::value<size_t>(), "minimum time per measurement in milliseconds")
+        ("r", program_options::value<size_t>(), "number of measurements, the median is reported");
+
+    program_options::variables_map options_var;
+
+    try {
+        program_options::store(program_options::parse_command_line(argc, argv, options), options_var);
+    }
+    catch (std::exception const& e) {
+        std::cout << e.what() << std::endl;
+        return -1;
+    }
+
+    program_options::notify(options_var);
+
+    if (options_var.count("help")) {
+        std::cout << options << std::endl;
+        return 1;
+    }
+    if (options_var.count("f")) {
+        filter = options_var["f"].as<std::string>();
+    }
+    if (options_var.count("m")) {
+        min_time = options_var["m"].as<size_t>();
+    }
+    if (options_var.count("r")) {
+        repetitions = options_var["r"].as<size_t>();
+    }
+
+    bench::MicroBench bench(filter, std::chrono::milliseconds(min_time), repetitions);
+    bench::bench_statis_update(bench);
+    bench::bench_work_queue(bench);
+    bench::bench_client_request(bench);
+    bench::bench_handle_request(bench);
+    bench::bench_parser(bench);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "parsercheck.h"
+
+#include <boost/program_options.hpp>
+#include <cstdint>
+#include <iostream>
+#include <random>
+
+namespace program_options = boost::program_options;
+
+// Exits with -1 when the fast parser disagrees with Beast on any input,
+// rerun with the printed seed to reproduce a failure.
+int main(int argc, char* argv[]) {
+    std::random_device random;
+    uint64_t seed = (uint64_t{ random() } << 32) | random();
+    size_t iterations = 100000;
+
+    program_options::options_description options("Parser Check Options");
+    options.add_options()
+        ("help", "parsercheck --seed 12345 --n 100000")
+        ("seed", program_options::value<uint64_t>(), "seed of the generated requests, random by default")
+        ("n", program_options::value<size_t>(), "number of generated requests per scanner");
+
+    program_options::variables_map options_var;
+
+    try {
+        program_options::store(program_options::parse_command_line(argc, argv, options), options_var);
+    }
+    catch (std::exception const& e) {
+        std::cout << e.what() << std::endl;
+        return -1;
+    }
+
+    program_options::notify(options_var);
+
+    if (options_var.count("help")) {
+        std::cout << options << std::endl;
+        return 1;
+    }
+    if (options_var.count("seed")) {
+        seed = options_var["seed"].as<uint64_t>();
+    }
+    if (options_var.count("n")) {
+        iterations = options_var["n"].as<size_t>();
+    }
+
+    std::cout << "Seed: " << seed << std::endl;
+    if (!bench::ParserCheck::run_all_scanners(seed, iterations)) {
+        std::cout << "Parser check failed, rerun with --seed " << seed << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "httpparser.h"
+
+namespace bench {
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+// Fuzzes HttpRequestParser against Beast's request_parser. Valid
+// generated requests, pipelined batches of them and randomly mutated
+// copies are fed to both parsers. The fast parser may reject input
+// Beast accepts, but whenever it accepts a request Beast must accept
+// the same request with the same fields.
+class ParserCheck final {
+public:
+    explicit ParserCheck(uint64_t seed)
+        : engine_(seed) {
+    }
+
+    bool run(size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            auto request = make_request();
+            check(request, false);
+
+            auto pipelined = request + make_request() + make_request();
+            check_pipelined(pipelined);
+
+            for (auto n = 0; n < 4; ++n) {
+                auto mutated = request;
+                mutate(mutated);
+                check(mutated, true);
+            }
+        }
+
+        std::cout << "Parser check: " << checked_ << " inputs, "
+            << agreed_ << " agreed, "
+            << stricter_ << " rejected only by the fast parser, "
+            << failed_ << " failed" << std::endl;
+        return failed_ == 0;
+    }
+
+    // Run the check once with every scanner the CPU supports
+    static bool run_all_scanners(uint64_t seed, size_t iterations) {
+        auto const detected = detail::detect_simd_level();
+        auto passed = true;
+        for (auto level : { detail::SimdLevel::kAvx2, detail::SimdLevel::kSse42, detail::SimdLevel::kScalar }) {
+            if (level > detected)
+                continue;
+            detail::simd_level() = level;
+            std::cout << "Scanner: " << detail::simd_level_name(level) << std::endl;
+            passed = ParserCheck(seed).run(iterations) && passed;
+        }
+        detail::simd_level() = detected;
+        return passed;
+    }
+
+private:
+    enum Result {
+        kComplete,
+        kIncomplete,
+        kError
+    };
+
+    struct Parsed {
+        Result result{ kError };
+        size_t consumed{ 0 };
+        std::string method;
+        std::string target;
+        unsigned version{ 0 };
+        bool keep_alive{ false };
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+    };
+
+    static Parsed parse_beast(std::string const& data) {
+        Parsed parsed;
+        http::request_parser<http::string_body> parser;
+        parser.eager(true);
+        parser.header_limit(HttpRequestParser::kHeaderLimit);
+        parser.body_limit(HttpRequestParser::kBodyLimit);
+
+        beast::error_code ec;
+        while (!parser.is_done()) {
+            auto n = parser.put(net::buffer(data.data() + parsed.consumed,
+                data.size() - parsed.consumed), ec);
+            parsed.consumed += n;
+            if (ec == http::error::need_more) {
+                parsed.result = kIncomplete;
+                return parsed;
+            }
+            if (ec) {
+                parsed.result = kError;
+                return parsed;
+            }
+            if (n == 0 && !parser.is_done()) {
+                parsed.result = kIncomplete;
+                return parsed;
+            }
+        }
+
+        auto const& req = parser.get();
+        parsed.result = kComplete;
+        parsed.method = std::string(req.method_string());
+        parsed.target = std::string(req.target());
+        parsed.version = req.version();
+        parsed.keep_alive = req.keep_alive();
+        for (auto const& field : req)
+            parsed.headers.emplace_back(std::string(field.name_string()), std::string(field.value()));
+        parsed.body = req.body();
+        return parsed;
+    }
+
+    static Parsed parse_fast(std::string const& data) {
+        Parsed parsed;
+        HttpRequestView req;
+        auto result = HttpRequestParser::parse(data.data(), data.size(), req);
+        if (result == HttpRequestParser::kIncomplete) {
+            parsed.result = kIncomplete;
+            return parsed;
+        }
+        if (result == HttpRequestParser::kError) {
+            parsed.result = kError;
+            return parsed;
+        }
+
+        parsed.result = kComplete;
+        parsed.consumed = static_cast<size_t>(result);
+        parsed.method = std::string(req.method);
+        parsed.target = std::string(req.target);
+        parsed.version = req.version;
+        parsed.keep_alive = req.keep_alive;
+        for (size_t i = 0; i < req.num_headers; ++i)
+            parsed.headers.emplace_back(std::string(req.headers[i].name), std::string(req.headers[i].value));
+        parsed.body = std::string(req.body);
+        return parsed;
+    }
+
+    // Beast keeps repeated fields next to each other, so headers are
+    // compared grouped by their case-insensitive name
+    static std::vector<std::pair<std::string, std::string>> grouped(Parsed const& parsed) {
+        auto headers = parsed.headers;
+        std::stable_sort(headers.begin(), headers.end(), [](auto const& lhs, auto const& rhs) {
+            return beast::iless()(lhs.first, rhs.first);
+        });
+        return headers;
+    }
+
+    static bool same(Parsed const& lhs, Parsed const& rhs) {
+        return lhs.consumed == rhs.consumed
+            && lhs.method == rhs.method
+            && lhs.target == rhs.target
+            && lhs.version == rhs.version
+            && lhs.keep_alive == rhs.keep_alive
+            && grouped(lhs) == grouped(rhs)
+            && lhs.body == rhs.body;
+    }
+
+    void check(std::string const& data, bool mutated) {
+        ++checked_;
+        auto const expected = parse_beast(data);
+        auto const actual = parse_fast(data);
+
+        if (actual.result == kComplete) {
+            if (expected.result == kComplete && same(expected, actual)) {
+                ++agreed_;
+                return;
+            }
+        } else if (expected.result != kComplete) {
+            ++agreed_;
+            return;
+        } else if (mutated) {
+            ++stricter_;
+            return;
+        }
+        report(data);
+    }
+
+    void check_pipelined(std::string data) {
+        while (!data.empty()) {
+            ++checked_;
+            auto const expected = parse_beast(data);
+            auto const actual = parse_fast(data);
+            if (expected.result != kComplete || actual.result != kComplete || !same(expected, actual)) {
+                report(data);
+                return;
+            }
+            ++agreed_;
+            data.erase(0, actual.consumed);
+        }
+    }
+
+    void report(std::string const& data) {
+        if (failed_++ < kMaxReports) {
+            std::cout << "Parser mismatch on input:" << std::endl;
+            for (auto c : data) {
+                auto const u = static_cast<unsigned char>(c);
+                if (u >= 0x20 && u < 0x7f && u != '\\')
+                    std::cout << c;
+                else
+                    std::cout << "\\x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<unsigned>(u) << std::dec;
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    size_t uniform(size_t min, size_t max) {
+        return std::uniform_int_distribution<size_t>(min, max)(engine_);
+    }
+
+    std::string make_token(size_t min, size_t max) {
+        static char const chars[] = "!#$%&'*+-.^_`|~0123456789"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+        std::string token(uniform(min, max), ' ');
+        for (auto& c : token)
+            c = chars[uniform(0, sizeof(chars) - 2)];
+        return token;
+    }
+
+    std::string make_text(size_t min, size_t max, bool allow_whitespace) {
+        std::string text(uniform(min, max), ' ');
+        for (auto& c : text) {
+            do {
+                c = static_cast<char>(uniform(0, 255));
+            } while ((static_cast<unsigned char>(c) < 0x20 && !(allow_whitespace && c == '\t'))
+                || c == 0x7f
+                || (!allow_whitespace && c == ' '));
+        }
+        return text;
+    }
+
+    std::string make_request() {
+        static char const* const methods[] = { "GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS" };
+
+        std::string request;
+        request += uniform(0, 3) == 0 ? make_token(1, 8) : methods[uniform(0, 5)];
+        request += ' ';
+        request += '/' + make_text(0, 80, false);
+        request += uniform(0, 3) == 0 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n";
+
+        for (auto n = uniform(0, 12); n > 0; --n) {
+            request += make_token(1, 20);
+            request += ':';
+            request += std::string(uniform(0, 2), ' ');
+            auto value = make_text(0, 60, true);
+            // Values may contain whitespace, but not at either end
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+                value.erase(0, 1);
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+                value.pop_back();
+            request += value;
+            request += std::string(uniform(0, 1), '\t');
+            request += "\r\n";
+        }
+
+        switch (uniform(0, 3)) {
+        case 0:
+            request += "Connection: close\r\n";
+            break;
+        case 1:
+            request += "Connection: keep-alive\r\n";
+            break;
+        default:
+            break;
+        }
+
+        auto const body = uniform(0, 3) == 0 ? make_text(1, 200, true) : std::string();
+        if (!body.empty() || uniform(0, 1) == 0)
+            request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        request += "\r\n";
+        request += body;
+        return request;
+    }
+
+    void mutate(std::string& data) {
+        static char const interesting[] = { '\r', '\n', ' ', '\t', ':', '\0', '\x7f', '\x80', '0', 'H', ',' };
+
+        auto const pos = uniform(0, data.size() - 1);
+        auto const c = uniform(0, 1) == 0
+            ? interesting[uniform(0, sizeof(interesting) - 1)]
+            : static_cast<char>(uniform(0, 255));
+        switch (uniform(0, 3)) {
+        case 0:
+            data[pos] = c;
+            break;
+        case 1:
+            data.insert(data.begin() + static_cast<std::ptrdiff_t>(pos), c);
+            break;
+        case 2:
+            data.erase(pos, 1);
+            break;
+        default:
+            data.resize(pos);
+            break;
+        }
+    }
+
+    enum {
+        kMaxReports = 10
+    };
+
+    std::mt19937_64 engine_;
+    size_t checked_{ 0 };
+    size_t agreed_{ 0 };
+    size_t stricter_{ 0 };
+    size_t failed_{ 0 };
+};
+
+}
@@ -11,16 +11,21 @@
 #include <boost/make_unique.hpp>
 #include <boost/optional.hpp>
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "error.h"
+#include "httpparser.h"
 #include "win32.h"
+#include "timerwheel.h"
+#include "workpool.h"
 
 namespace bench {
 
@@ -43,6 +48,90 @@ public:
     }
 };
 
+struct ServerOptions {
+    std::string doc_root;
+    // Synthetic CPU cost spent by every request handler
+    std::chrono::microseconds handler_cost{ 0 };
+    // When set, handlers run here instead of on the I/O threads
+    WorkStealingPool* handler_pool{ nullptr };
+    // Serves the /delay and /jitter routes
+    DelayScheduler* delay_scheduler{ nullptr };
+    // Parse requests in place with HttpRequestParser instead of Beast
+    bool fast_parser{ false };
+    // Free the buffer, parser and queue of a connection while it waits
+    // for its next request, and never time idle connections out
+    bool release_idle{ false };
+};
+
+// Returns how long the synthetic slow backend routes should wait before
+// responding, all values in microseconds:
+//   /delay/<us>
+//   /jitter/uniform:<min>:<max>
+//   /jitter/exp:<mean>
+//   /jitter/normal:<mean>:<stddev>
+//   /jitter/lognormal:<median>:<sigma>
+// Anything else, including malformed routes, responds immediately.
+// Delays are capped at one hour.
+inline std::chrono::microseconds route_delay(beast::string_view target) {
+    static beast::string_view const kDelay = "/delay/";
+    static beast::string_view const kJitter = "/jitter/";
+    static constexpr double kMaxDelayUs = 3600.0 * 1000 * 1000;
+
+    // Clamp before converting, out of range doubles are undefined
+    // behavior to cast and would overflow the scheduler's time points
+    auto const to_delay = [](double us) {
+        if (!(us > 0))
+            return std::chrono::microseconds(0);
+        return std::chrono::microseconds(static_cast<int64_t>((std::min)(us, kMaxDelayUs)));
+    };
+
+    if (target.starts_with(kDelay)) {
+        return to_delay(std::strtod(std::string(target.substr(kDelay.size())).c_str(), nullptr));
+    }
+    if (!target.starts_with(kJitter)) {
+        return std::chrono::microseconds(0);
+    }
+
+    // Split "<name>:<arg>:<arg>" into the distribution name and its arguments
+    auto const spec = std::string(target.substr(kJitter.size()));
+    auto const name_end = spec.find(':');
+    auto const name = spec.substr(0, name_end);
+    std::vector<double> args;
+    for (auto pos = name_end; pos != std::string::npos; pos = spec.find(':', pos + 1)) {
+        args.push_back(std::strtod(spec.c_str() + pos + 1, nullptr));
+    }
+
+    static thread_local std::mt19937_64 engine{ std::random_device{}() };
+    if (name == "uniform" && args.size() == 2 && args[0] <= args[1]) {
+        return to_delay(std::uniform_real_distribution<double>(args[0], args[1])(engine));
+    }
+    if (name == "exp" && args.size() == 1 && args[0] > 0) {
+        return to_delay(std::exponential_distribution<double>(1.0 / args[0])(engine));
+    }
+    if (name == "normal" && args.size() == 2 && args[1] >= 0) {
+        return to_delay(std::normal_distribution<double>(args[0], args[1])(engine));
+    }
+    if (name == "lognormal" && args.size() == 2 && args[0] > 0 && args[1] >= 0) {
+        return to_delay(std::lognormal_distribution<double>(std::log(args[0]), args[1])(engine));
+    }
+    return std::chrono::microseconds(0);
+}
+
+inline http::response<http::string_body> make_response(
+    ServerOptions const& options,
+    unsigned version,
+    bool keep_alive) {
+    burn_cpu(options.handler_cost);
+
+    http::response<http::string_body> res{ http::status::not_found, version };
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");    
+    res.body() = "Hello, world";
+    res.prepare_payload();
+    res.keep_alive(keep_alive);
+    return res;
+}
+
 template
 <
     class Body,
@@ -50,108 +139,143 @@ template
     class Send
 >
 void handle_request(
-    beast::string_view doc_root,
+    ServerOptions const& options,
     http::request<Body, http::basic_fields<Allocator>>&& req,
     Send&& send) {
-    http::response<http::string_body> res{ http::status::not_found, req.version() };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, "text/html");    
-    res.body() = "Hello, world";
-    res.prepare_payload();
-    res.keep_alive(req.keep_alive());
-    return send(std::move(res));
+    return send(make_response(options, req.version(), req.keep_alive()));
 }
 
-class HttpSession final : public std::enable_shared_from_this<HttpSession> {
+template<class Send>
+void handle_request(
+    ServerOptions const& options,
+    HttpRequestView const& req,
+    Send&& send) {
+    return send(make_response(options, req.version, req.keep_alive));
+}
+
+// Copy a parsed request out of the read buffer, for handlers that
+// outlive the buffer contents.
+inline http::request<http::string_body> to_request(HttpRequestView const& view) {
+    http::request<http::string_body> req;
+    req.method_string(view.method);
+    req.target(view.target);
+    req.version(view.version);
+    for (size_t i = 0; i < view.num_headers; ++i)
+        req.insert(view.headers[i].name, view.headers[i].value);
+    req.body().assign(view.body.data(), view.body.size());
+    return req;
+}
+
+// Holds the responses of pipelined requests so they are written in
+// the order the requests arrived. `Session` starts each write with
+// `do_write(msg)` and calls `on_write()` when that write completes.
+template <typename Session>
+class BasicWorkQueue {
+    enum {
+        // Maximum number of responses we will queue
+        kLimit = 4096
+    };
+
+    // The type-erased, saved work item
+    struct Work {
+        virtual ~Work() = default;
+        virtual void operator()() = 0;
+    };
+
+    Session& self_;
+    std::vector<std::unique_ptr<Work>> items_;
+
 public:
-    class WorkQueue {
-        enum {
-            // Maximum number of responses we will queue
-            kLimit = 4096
-        };
+    // Storage grows with the pipelining depth, an idle connection
+    // does not pay for the full limit up front
+    explicit BasicWorkQueue(Session& self)
+        : self_(self) {
+        static_assert(kLimit > 0, "queue limit must be positive");
+    }
 
-        // The type-erased, saved work item
-        struct Work {
-            virtual ~Work() = default;
-            virtual void operator()() = 0;
-        };
+    // Returns `true` if we have reached the queue limit
+    bool is_full() const {
+        return items_.size() >= kLimit;
+    }
 
-        HttpSession& self_;
-        std::vector<std::unique_ptr<Work>> items_;
+    // Free the storage of an empty queue
+    void release() {
+        if (items_.empty())
+            std::vector<std::unique_ptr<Work>>().swap(items_);
+    }
 
-    public:
-        explicit WorkQueue(HttpSession& self)
-            : self_(self) {
-            static_assert(kLimit > 0, "queue limit must be positive");
-            items_.reserve(kLimit);
-        }
+    // Called when a message finishes sending
+    // Returns `true` if the caller should initiate a read
+    bool on_write() {
+        BOOST_ASSERT(!items_.empty());
+        auto const was_full = is_full();
+        items_.erase(items_.begin());
+        if (!items_.empty())
+            (*items_.front())();
+        return was_full;
+    }
 
-        // Returns `true` if we have reached the queue limit
-        bool is_full() const {
-            return items_.size() >= kLimit;
-        }
+    // Called by the HTTP handler to send a response.
+    template<bool isRequest, class Body, class Fields>
+    void operator()(http::message<isRequest, Body, Fields>&& msg) {
+        // This holds a work item
+        struct WorkImpl final : Work {
+            Session& self_;
+            http::message<isRequest, Body, Fields> msg_;
+
+            WorkImpl(Session& self,
+                http::message<isRequest, Body, Fields>&& msg)
+                : self_(self)
+                , msg_(std::move(msg)) {
+            }
+
+            void operator()() override {
+                self_.do_write(msg_);
+            }
+        };
 
-        // Called when a message finishes sending
-        // Returns `true` if the caller should initiate a read
-        bool on_write() {
-            BOOST_ASSERT(!items_.empty());
-            auto const was_full = is_full();
-            items_.erase(items_.begin());
-            if (!items_.empty())
-                (*items_.front())();
-            return was_full;
-        }
+        // Allocate and store the work
+        items_.push_back(boost::make_unique<WorkImpl>(self_, std::move(msg)));
 
-        // Called by the HTTP handler to send a response.
-        template<bool isRequest, class Body, class Fields>
-        void operator()(http::message<isRequest, Body, Fields>&& msg) {
-            // This holds a work item
-            struct WorkImpl final : Work {
-                HttpSession& self_;
-                http::message<isRequest, Body, Fields> msg_;
-
-                WorkImpl(HttpSession& self,
-                    http::message<isRequest, Body, Fields>&& msg)
-                    : self_(self)
-                    , msg_(std::move(msg)) {
-                }
-
-                void operator()() override {
-                    http::async_write(
-                        self_.stream_,
-                        msg_,
-                        beast::bind_front_handler(
-                            &HttpSession::on_write,
-                            self_.shared_from_this(),
-                            msg_.need_eof()));
-                }
-            };
-
-            // Allocate and store the work
-            items_.push_back(boost::make_unique<WorkImpl>(self_, std::move(msg)));
-
-            // If there was no previous work, start this one
-            if (items_.size() == 1)
-                (*items_.front())();
-        }
+        // If there was no previous work, start this one
+        if (items_.size() == 1)
+            (*items_.front())();
+    }
+};
+
+class HttpSession final : public std::enable_shared_from_this<HttpSession> {
+public:
+    using WorkQueue = BasicWorkQueue<HttpSession>;
+    friend WorkQueue;
+
+    enum {
+        // Bytes requested per read by the fast parser path
+        kReadSize = 4096
     };
 
     beast::tcp_stream stream_;
     beast::flat_buffer buffer_;
-    std::shared_ptr<std::string const> doc_root_;
+    std::shared_ptr<ServerOptions const> options_;
     WorkQueue queue_;
 
     // The parser is stored in an optional container so we can
     // construct it from scratch it at the beginning of each new message.
-    boost::optional<http::request_parser<http::string_body>> parser_;
+    // The container is allocated once per connection, and only freed
+    // while the connection is idle.
+    std::unique_ptr<boost::optional<http::request_parser<http::string_body>>> parser_;
 
 public:
     // Take ownership of the socket
     HttpSession(tcp::socket&& socket,
-        std::shared_ptr<std::string const> const& doc_root)
+        std::shared_ptr<ServerOptions const> const& options)
         : stream_(std::move(socket))
-        , doc_root_(doc_root)
+        , options_(options)
         , queue_(*this) {        
+        HttpStatis::get().update_connection(true);
+    }
+
+    ~HttpSession() {
+        HttpStatis::get().update_connection(false);
     }
 
     // Start the session
@@ -170,12 +294,23 @@ public:
 
 private:
     void do_read() {
+        if (options_->fast_parser)
+            return do_fast_read();
+        if (is_idle())
+            return do_wait();
+        do_read_request();
+    }
+
+    void do_read_request() {
         // Construct a new parser for each message
-        parser_.emplace();
+        if (!parser_)
+            parser_ = boost::make_unique<boost::optional<http::request_parser<http::string_body>>>();
+        parser_->emplace();
+        auto& parser = **parser_;
 
         // Apply a reasonable limit to the allowed size
         // of the body in bytes to prevent abuse.
-        parser_->body_limit(10000);
+        parser.body_limit(10000);
 
         // Set the timeout.
         stream_.expires_after(std::chrono::seconds(30));
@@ -184,7 +319,7 @@ private:
         http::async_read(
             stream_,
             buffer_,
-            *parser_,
+            parser,
             beast::bind_front_handler(
                 &HttpSession::on_read,
                 shared_from_this()));
@@ -192,6 +327,7 @@ private:
 
     void on_read(beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
+        BusyScope busy(BusyScope::kIoThread);
 
         // This means they closed the connection
         if (ec == http::error::end_of_stream)
@@ -200,25 +336,188 @@ private:
         if (ec)
             return fail(ec, "read");
 
+        auto& parser = **parser_;
+
         // See if it is a WebSocket Upgrade
-        if (websocket::is_upgrade(parser_->get())) {
+        if (websocket::is_upgrade(parser.get())) {
             // Create a websocket session, transferring ownership
             // of both the socket and the HTTP request.
             std::make_shared<WebsocketSession>(
-                stream_.release_socket())->do_accept(parser_->release());
+                stream_.release_socket())->do_accept(parser.release());
             return;
         }
 
+        // Synthetic slow backend routes wait on the timer wheel first
+        auto const delay = route_delay(parser.get().target());
+        if (delay.count() > 0 && options_->delay_scheduler)
+            return do_delay(delay, parser.release());
+
+        do_handle(parser.release());
+    }
+
+    void do_fast_read() {
+        // Serve every complete request already in the buffer before
+        // going back to the socket, several per read when pipelined.
+        while (buffer_.size() > 0) {
+            auto const data = static_cast<char const*>(buffer_.data().data());
+            HttpRequestView req;
+            auto const result = HttpRequestParser::parse(data, buffer_.size(), req);
+            if (result == HttpRequestParser::kIncomplete)
+                break;
+            if (result == HttpRequestParser::kError) {
+                // Stop reading like a read error on the Beast path does,
+                // responses to the requests before it still drain
+                return fail(beast::errc::make_error_code(beast::errc::bad_message), "parse");
+            }
+
+            // Deferred handlers outlive the buffer, so they get a copy
+            auto const delay = route_delay(req.target);
+            if (delay.count() > 0 && options_->delay_scheduler) {
+                auto owned = to_request(req);
+                buffer_.consume(static_cast<size_t>(result));
+                return do_delay(delay, std::move(owned));
+            }
+            if (options_->handler_pool) {
+                auto owned = to_request(req);
+                buffer_.consume(static_cast<size_t>(result));
+                return do_offload(std::move(owned));
+            }
+
+            handle_request(*options_, req, queue_);
+            buffer_.consume(static_cast<size_t>(result));
+
+            if (queue_.is_full())
+                return;
+        }
+
+        if (is_idle())
+            return do_wait();
+        do_read_some();
+    }
+
+    void do_read_some() {
+        stream_.expires_after(std::chrono::seconds(30));
+        stream_.async_read_some(
+            buffer_.prepare(kReadSize),
+            beast::bind_front_handler(
+                &HttpSession::on_fast_read,
+                shared_from_this()));
+    }
+
+    // Nothing is buffered, so the next request has not started yet
+    bool is_idle() const {
+        return options_->release_idle && buffer_.size() == 0;
+    }
+
+    void do_wait() {
+        // Give back everything the last request used and only wait for
+        // the socket to become readable, without a buffer to read into
+        parser_.reset();
+        buffer_.shrink_to_fit();
+        queue_.release();
+
+        // Idle keep-alive connections, like long-polls, stay open
+        stream_.expires_never();
+        stream_.socket().async_wait(
+            tcp::socket::wait_read,
+            beast::bind_front_handler(
+                &HttpSession::on_readable,
+                shared_from_this()));
+    }
+
+    void on_readable(beast::error_code ec) {
+        if (ec)
+            return fail(ec, "wait");
+
+        if (options_->fast_parser)
+            return do_read_some();
+        do_read_request();
+    }
+
+    void on_fast_read(beast::error_code ec, std::size_t bytes_transferred) {
+        BusyScope busy(BusyScope::kIoThread);
+
+        // This means they closed the connection
+        if (ec == net::error::eof)
+            return do_close();
+
+        if (ec)
+            return fail(ec, "read");
+
+        buffer_.commit(bytes_transferred);
+        do_fast_read();
+    }
+
+    void do_handle(http::request<http::string_body>&& req) {
+        if (options_->handler_pool)
+            return do_offload(std::move(req));
+
         // Send the response
-        handle_request(*doc_root_, parser_->release(), queue_);
+        handle_request(*options_, std::move(req), queue_);
 
         // If we aren't at the queue limit, try to pipeline another request
         if (!queue_.is_full())
             do_read();
     }
 
+    void do_delay(std::chrono::microseconds delay, http::request<http::string_body>&& req) {
+        // Park the request on the timer wheel and come back to our strand
+        // when it fires. Reading stays paused until then, so pipelined
+        // responses cannot overtake each other.
+        options_->delay_scheduler->schedule(
+            delay,
+            [self = shared_from_this(), req = std::move(req)]() mutable {
+                net::post(
+                    self->stream_.get_executor(),
+                    [self, req = std::move(req)]() mutable {
+                        BusyScope busy(BusyScope::kIoThread);
+                        self->do_handle(std::move(req));
+                    });
+            });
+    }
+
+    void do_offload(http::request<http::string_body>&& req) {
+        // Run the handler on the worker pool and post the response back
+        // to our strand. Reading stays paused until then, so pipelined
+        // responses cannot overtake each other.
+        options_->handler_pool->post(
+            [self = shared_from_this(), req = std::move(req)]() mutable {
+                handle_request(*self->options_, std::move(req),
+                    [&self](auto&& msg) {
+                        net::post(
+                            self->stream_.get_executor(),
+                            [self, msg = std::move(msg)]() mutable {
+                                self->on_offload(std::move(msg));
+                            });
+                    });
+            });
+    }
+
+    template<bool isRequest, class Body, class Fields>
+    void on_offload(http::message<isRequest, Body, Fields>&& msg) {
+        BusyScope busy(BusyScope::kIoThread);
+
+        queue_(std::move(msg));
+
+        if (!queue_.is_full())
+            do_read();
+    }
+
+    // Called by the queue to start sending a response
+    template<bool isRequest, class Body, class Fields>
+    void do_write(http::message<isRequest, Body, Fields>& msg) {
+        http::async_write(
+            stream_,
+            msg,
+            beast::bind_front_handler(
+                &HttpSession::on_write,
+                shared_from_this(),
+                msg.need_eof()));
+    }
+
     void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
+        BusyScope busy(BusyScope::kIoThread);
         stream_.expires_after(std::chrono::seconds(30));
 
         if (ec)
@@ -232,10 +531,16 @@ private:
 
         // Inform the queue that a write completed
         if (queue_.on_write()) {
-            // Read another request
-            buffer_.consume(buffer_.size());
+            // Read another request. The fast parser may still hold
+            // pipelined requests in the buffer.
+            if (!options_->fast_parser)
+                buffer_.consume(buffer_.size());
             do_read();
         }
+
+        // The last response may finish after we started waiting
+        if (options_->release_idle)
+            queue_.release();
     }
 
     void do_close() {
@@ -249,10 +554,10 @@ private:
 
 class HttpServer final : public std::enable_shared_from_this<HttpServer> {
 public:
-    HttpServer(net::io_context& ioc, tcp::endpoint endpoint, std::shared_ptr<std::string const> const& doc_root)
+    HttpServer(net::io_context& ioc, tcp::endpoint endpoint, std::shared_ptr<ServerOptions const> const& options)
         : ioc_(ioc)
         , acceptor_(net::make_strand(ioc))
-        , doc_root_(doc_root) {
+        , options_(options) {
         beast::error_code ec;
 
         // Open the acceptor
@@ -325,7 +630,7 @@ private:
             // Create the http session and run it
             std::make_shared<HttpSession>(
                 std::move(socket),
-                doc_root_)->run();
+                options_)->run();
         }
 
         // Accept another connection
@@ -334,7 +639,7 @@ private:
 
     net::io_context& ioc_;
     tcp::acceptor acceptor_;
-    std::shared_ptr<std::string const> doc_root_;
+    std::shared_ptr<ServerOptions const> options_;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "httpstatis.h"
+
+namespace bench {
+
+namespace net = boost::asio;                    // from <boost/asio.hpp>
+
+// A hierarchical timing wheel counted in abstract ticks. Level 0 holds
+// the next kSlots ticks, every level above covers kSlots times the range
+// of the one below and is cascaded down when the lower level wraps.
+class TimerWheel final {
+public:
+    using Callback = std::function<void()>;
+
+    enum {
+        kSlotBits = 6,
+        kSlots = 1 << kSlotBits,
+        kLevels = 4
+    };
+
+    explicit TimerWheel(uint64_t now = 0) noexcept
+        : now_(now) {
+    }
+
+    uint64_t now() const noexcept {
+        return now_;
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    // Schedule `callback` to expire at the absolute `tick`. Ticks that
+    // are already due expire on the next advance.
+    void schedule_at(uint64_t tick, Callback callback) {
+        insert(Entry{ (std::max)(tick, now_ + 1), std::move(callback) });
+        ++size_;
+    }
+
+    // The first tick after now that expires a level 0 slot or cascades a
+    // non-empty slot of a higher level, nothing happens on the ticks in
+    // between. UINT64_MAX when the wheel is empty.
+    uint64_t next_tick() const noexcept {
+        auto next = UINT64_MAX;
+        // Level 0 only holds the ticks up to now + kSlots - 1
+        for (uint64_t tick = now_ + 1; tick < now_ + kSlots; ++tick) {
+            if (!levels_[0][tick & (kSlots - 1)].empty()) {
+                next = tick;
+                break;
+            }
+        }
+        // Slots of level n are cascaded on multiples of kSlots^n
+        for (auto level = 1; level < kLevels; ++level) {
+            auto const shift = kSlotBits * level;
+            for (uint64_t block = (now_ >> shift) + 1; block <= (now_ >> shift) + kSlots; ++block) {
+                if ((block << shift) >= next)
+                    break;
+                if (!levels_[level][block & (kSlots - 1)].empty()) {
+                    next = block << shift;
+                    break;
+                }
+            }
+        }
+        return next;
+    }
+
+    // Advance the wheel to the absolute `tick` and hand every expired
+    // callback to `on_expired`.
+    template <typename OnExpired>
+    void advance_to(uint64_t tick, OnExpired&& on_expired) {
+        while (now_ < tick) {
+            auto const next = next_tick();
+            if (next > tick) {
+                now_ = tick;
+                return;
+            }
+
+            now_ = next;
+            cascade();
+
+            auto& slot = levels_[0][now_ & (kSlots - 1)];
+            if (slot.empty())
+                continue;
+
+            expired_.swap(slot);
+            size_ -= expired_.size();
+            for (auto& entry : expired_)
+                on_expired(entry.callback);
+            expired_.clear();
+        }
+    }
+
+private:
+    struct Entry {
+        uint64_t expiry;
+        Callback callback;
+    };
+
+    using Slot = std::vector<Entry>;
+
+    void insert(Entry&& entry) {
+        auto delta = entry.expiry - now_;
+        auto level = 0;
+        while (level < kLevels - 1
+            && delta >= (uint64_t{ 1 } << (kSlotBits * (level + 1)))) {
+            ++level;
+        }
+
+        // Anything beyond the top level parks in its furthest slot and
+        // gets re-inserted when that slot is cascaded.
+        auto expiry = (std::min)(entry.expiry,
+            now_ + (uint64_t{ 1 } << (kSlotBits * kLevels)) - 1);
+        auto index = (expiry >> (kSlotBits * level)) & (kSlots - 1);
+        levels_[level][index].push_back(std::move(entry));
+    }
+
+    void cascade() {
+        for (auto level = 1; level < kLevels; ++level) {
+            if (((now_ >> (kSlotBits * (level - 1))) & (kSlots - 1)) != 0)
+                return;
+
+            auto& slot = levels_[level][(now_ >> (kSlotBits * level)) & (kSlots - 1)];
+            if (slot.empty())
+                continue;
+
+            cascaded_.swap(slot);
+            for (auto& entry : cascaded_)
+                insert(std::move(entry));
+            cascaded_.clear();
+        }
+    }
+
+    uint64_t now_;
+    size_t size_{ 0 };
+    std::array<std::array<Slot, kSlots>, kLevels> levels_;
+    Slot expired_;
+    Slot cascaded_;
+};
+
+// Runs delayed completions off one timer wheel per I/O thread. Each
+// wheel is driven by a single steady_timer that fires on the next tick
+// with something to do and completes everything due in a batch,
+// instead of arming a heap timer per request.
+class DelayScheduler final {
+public:
+    DelayScheduler(net::io_context& ioc,
+        size_t threads,
+        std::chrono::microseconds tick = std::chrono::microseconds(100))
+        : tick_(tick)
+        , epoch_(Clock::now()) {
+        shards_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i)
+            shards_.push_back(std::make_unique<Shard>(ioc));
+    }
+
+    std::chrono::microseconds tick() const noexcept {
+        return tick_;
+    }
+
+    // Call `handler` from a timer thread once `delay` has passed. The
+    // handler is expected to post its real work to its own strand.
+    void schedule(std::chrono::microseconds delay, std::function<void()> handler) {
+        auto& shard = local_shard();
+        auto const scheduled = Clock::now();
+        auto const due = scheduled + delay - epoch_;
+        auto const tick = static_cast<uint64_t>((due + tick_ - Clock::duration(1)) / tick_);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.wheel.empty()) {
+            // An idle wheel is not ticking, catch it up before inserting
+            shard.wheel.advance_to(static_cast<uint64_t>((scheduled - epoch_) / tick_),
+                [](TimerWheel::Callback&) {});
+        }
+        auto const due_tick = (std::max)(tick, shard.wheel.now() + 1);
+        shard.wheel.schedule_at(tick,
+            [delay, scheduled, handler = std::move(handler)]() {
+                HttpStatis::get().update_delay(delay,
+                    std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - scheduled));
+                handler();
+            });
+        if (!shard.armed || due_tick < shard.armed_tick)
+            arm(shard, due_tick);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Shard {
+        explicit Shard(net::io_context& ioc)
+            : timer(net::make_strand(ioc)) {
+        }
+
+        std::mutex mutex;
+        TimerWheel wheel;
+        net::steady_timer timer;
+        bool armed{ false };
+        uint64_t armed_tick{ 0 };
+        std::vector<TimerWheel::Callback> batch;
+    };
+
+    Shard& local_shard() {
+        static std::atomic<size_t> next_shard{ 0 };
+        static thread_local size_t index = next_shard++;
+        return *shards_[index % shards_.size()];
+    }
+
+    // Must be called with the shard mutex held. Re-arming cancels the
+    // pending wait.
+    void arm(Shard& shard, uint64_t tick) {
+        shard.armed = true;
+        shard.armed_tick = tick;
+        shard.timer.expires_at(epoch_ + tick_ * static_cast<int64_t>(tick));
+        shard.timer.async_wait([this, &shard](boost::system::error_code ec) {
+            if (!ec)
+                on_tick(shard);
+        });
+    }
+
+    void on_tick(Shard& shard) {
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto const now = static_cast<uint64_t>((Clock::now() - epoch_) / tick_);
+            shard.wheel.advance_to(now, [&shard](TimerWheel::Callback& callback) {
+                shard.batch.push_back(std::move(callback));
+            });
+            shard.armed = false;
+            if (!shard.wheel.empty())
+                arm(shard, shard.wheel.next_tick());
+        }
+
+        for (auto& callback : shard.batch)
+            callback();
+        shard.batch.clear();
+    }
+
+    std::chrono::microseconds tick_;
+    Clock::time_point epoch_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}
@@ -3,6 +3,17 @@
 #include <Windows.h>
 #include <mstcpip.h>
 #include <WinSock2.h>
+#include <Psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+// Older SDK headers only define these for newer target versions
+#ifndef SO_PORT_SCALABILITY
+#define SO_PORT_SCALABILITY 0x3006
+#endif
+#ifndef SO_REUSE_UNICASTPORT
+#define SO_REUSE_UNICASTPORT 0x3007
+#endif
 
 #include "error.h"
 
@@ -27,9 +38,32 @@ static void enable_fast_loopback(SOCKET socket) {
     }
 }
 
+// Defers the choice of the local port of a socket bound to an explicit
+// address with port 0 to connect time. Without it every such bind takes
+// a port from the single system-wide ephemeral pool, whatever the
+// address. Falls back to SO_PORT_SCALABILITY before Windows 10.
+static void reuse_unicast_port(tcp::socket & socket, boost::system::error_code& ec) {
+    typedef boost::asio::detail::socket_option::boolean<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_REUSE_UNICASTPORT> reuse_unicast_port;
+    typedef boost::asio::detail::socket_option::boolean<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_PORT_SCALABILITY> port_scalability;
+    socket.set_option(reuse_unicast_port(true), ec);
+    if (ec) {
+        socket.set_option(port_scalability(true), ec);
+    }
+}
+
 static void excluse_address(tcp::acceptor & acceptor, boost::system::error_code& ec) {
     typedef boost::asio::detail::socket_option::boolean<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_EXCLUSIVEADDRUSE> excluse_address;
     acceptor.set_option(excluse_address(true), ec);
 }
 
+// Resident memory (working set) of this process in bytes
+static size_t process_memory_usage() {
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!::GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters))) {
+        system_error(::GetLastError());
+        return 0;
+    }
+    return counters.WorkingSetSize;
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "httpstatis.h"
+
+namespace bench {
+
+// Spin on the calling thread for roughly `cost`, standing in for
+// the CPU a real handler spends on rendering or compression.
+inline void burn_cpu(std::chrono::microseconds cost) noexcept {
+    if (cost.count() <= 0)
+        return;
+
+    Stopwatch watch;
+    volatile uint64_t sink = 0;
+    while (watch.elapsed() < cost) {
+        for (auto i = 0; i < 64; ++i)
+            sink = sink * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+}
+
+// A fixed-size thread pool where every worker owns a queue. A worker
+// pops its own queue from the front and, when that runs dry, steals
+// from the back of the other queues before going to sleep.
+class WorkStealingPool final {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(size_t threads) {
+        queues_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i)
+            queues_.push_back(std::make_unique<Queue>());
+
+        threads_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this, i] {
+                run(i);
+                });
+        }
+    }
+
+    WorkStealingPool(WorkStealingPool const&) = delete;
+    WorkStealingPool& operator=(WorkStealingPool const&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            stop_ = true;
+        }
+        wait_cond_.notify_all();
+
+        for (auto& t : threads_) {
+            if (!t.joinable()) {
+                continue;
+            }
+            t.join();
+        }
+    }
+
+    size_t size() const noexcept {
+        return queues_.size();
+    }
+
+    // Queue a task. Tasks posted from a worker stay on that worker's
+    // queue, everything else is spread round-robin.
+    void post(Task task) {
+        auto index = (current_pool() == this)
+            ? current_index()
+            : next_++ % queues_.size();
+        ++pending_;
+        {
+            auto& queue = *queues_[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+
+        // A worker counts itself as a sleeper before it checks pending_,
+        // so either it sees this task or we see it and wake it up. The
+        // lock makes sure it is really waiting before we notify.
+        if (sleepers_ > 0) {
+            {
+                std::lock_guard<std::mutex> lock(wait_mutex_);
+            }
+            wait_cond_.notify_one();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool try_pop(size_t index, Task& task) {
+        auto& queue = *queues_[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+
+    bool try_steal(size_t index, Task& task) {
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            auto& queue = *queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t index) {
+        current_pool() = this;
+        current_index() = index;
+
+        Task task;
+        while (true) {
+            if (try_pop(index, task) || try_steal(index, task)) {
+                --pending_;
+                BusyScope busy(BusyScope::kWorker);
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(wait_mutex_);
+            ++sleepers_;
+            wait_cond_.wait(lock, [this] {
+                return stop_ || pending_ > 0;
+                });
+            --sleepers_;
+            if (stop_)
+                return;
+        }
+    }
+
+    static WorkStealingPool*& current_pool() noexcept {
+        static thread_local WorkStealingPool* pool = nullptr;
+        return pool;
+    }
+
+    static size_t& current_index() noexcept {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_{ 0 };
+    std::atomic<size_t> pending_{ 0 };
+    std::atomic<size_t> sleepers_{ 0 };
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cond_;
+    bool stop_{ false };
+};
+
+}